@@ -0,0 +1,351 @@
+/* LD_PRELOAD shim for REDO_DEPTRACE, see redo.c
+
+   Built as redo-trace.so, it is loaded into the processes of .do files
+   which redo runs with REDO_DEPTRACE set, and reports the files they
+   access to the file descriptor REDO_DEPTRACE_FD, one line each:
+
+     r /abs/path   opened for reading
+     w /abs/path   opened for writing
+     m /abs/path   probed (open, stat, statx, access) but does not exist
+
+   redo turns them into dep records when the job is done.  Processes of
+   redo itself, and programs linked statically, are not traced.
+
+   Released under the same terms as redo.c.
+*/
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int trace_fd = -1;
+
+__attribute__((constructor)) static void
+trace_init()
+{
+    char exe[PATH_MAX], *s = getenv("REDO_DEPTRACE_FD"), *base;
+    ssize_t r = readlink("/proc/self/exe", exe, sizeof exe - 1);
+
+    if (!s || !*s)
+	return;
+    // the redo processes called by the .do file keep their own books
+    exe[r > 0 ? r : 0] = 0;
+    base = strrchr(exe, '/');
+    if (r > 0 && !strcmp(base ? base + 1 : exe, "redo"))
+	return;
+    trace_fd = atoi(s);
+    if (fcntl(trace_fd, F_GETFD) < 0)
+	trace_fd = -1;
+}
+
+// report path, relative to directory dirfd, as kind
+static void
+trace(char kind, int dirfd, const char *path)
+{
+    char dir[PATH_MAX], buf[2*PATH_MAX+4];
+    int saved = errno, n;
+    ssize_t r;
+
+    if (trace_fd < 0 || !path || !*path)
+	return;
+    if (*path == '/') {
+	n = snprintf(buf, sizeof buf, "%c %s\n", kind, path);
+    } else {
+	if (dirfd == AT_FDCWD) {
+	    if (!getcwd(dir, sizeof dir))
+		goto out;
+	} else {
+	    char link[64];
+	    snprintf(link, sizeof link, "/proc/self/fd/%d", dirfd);
+	    if ((r = readlink(link, dir, sizeof dir - 1)) <= 0)
+		goto out;
+	    dir[r] = 0;
+	}
+	n = snprintf(buf, sizeof buf, "%c %s%s%s\n", kind, dir,
+		     strcmp(dir, "/") ? "/" : "", path);
+    }
+    // one write, appended as a whole
+    if (n > 0 && (size_t)n < sizeof buf)
+	write(trace_fd, buf, n);
+out:
+    errno = saved;
+}
+
+// an open of path with flags returned r
+static void
+trace_open(int dirfd, const char *path, int flags, int r)
+{
+    if (r >= 0) {
+	if (!(flags & O_DIRECTORY))
+	    trace((flags & O_ACCMODE) == O_RDONLY ? 'r' : 'w', dirfd, path);
+    } else if (errno == ENOENT) {
+	trace('m', dirfd, path);
+    }
+}
+
+static void
+trace_probe(int dirfd, const char *path, int r)
+{
+    if (r < 0 && errno == ENOENT)
+	trace('m', dirfd, path);
+}
+
+#define NEXT(name) \
+    static __typeof__(name) *next_##name; \
+    if (!next_##name) \
+	next_##name = (__typeof__(name) *)dlsym(RTLD_NEXT, #name)
+
+// the mode argument is only there with O_CREAT or O_TMPFILE
+#define MODE(flags, mode) \
+    mode_t mode = 0; \
+    if ((flags) & O_CREAT || ((flags) & O_TMPFILE) == O_TMPFILE) { \
+	va_list ap; \
+	va_start(ap, flags); \
+	mode = va_arg(ap, int); \
+	va_end(ap); \
+    }
+
+int
+open(const char *path, int flags, ...)
+{
+    MODE(flags, mode);
+    NEXT(open);
+    int r = next_open(path, flags, mode);
+    trace_open(AT_FDCWD, path, flags, r);
+    return r;
+}
+
+int
+open64(const char *path, int flags, ...)
+{
+    MODE(flags, mode);
+    NEXT(open64);
+    int r = next_open64(path, flags, mode);
+    trace_open(AT_FDCWD, path, flags, r);
+    return r;
+}
+
+int
+openat(int dirfd, const char *path, int flags, ...)
+{
+    MODE(flags, mode);
+    NEXT(openat);
+    int r = next_openat(dirfd, path, flags, mode);
+    trace_open(dirfd, path, flags, r);
+    return r;
+}
+
+int
+openat64(int dirfd, const char *path, int flags, ...)
+{
+    MODE(flags, mode);
+    NEXT(openat64);
+    int r = next_openat64(dirfd, path, flags, mode);
+    trace_open(dirfd, path, flags, r);
+    return r;
+}
+
+// the fortified variants, without a mode
+int __open_2(const char *path, int flags);
+int __open64_2(const char *path, int flags);
+int __openat_2(int dirfd, const char *path, int flags);
+int __openat64_2(int dirfd, const char *path, int flags);
+
+int
+__open_2(const char *path, int flags)
+{
+    NEXT(__open_2);
+    int r = next___open_2(path, flags);
+    trace_open(AT_FDCWD, path, flags, r);
+    return r;
+}
+
+int
+__open64_2(const char *path, int flags)
+{
+    NEXT(__open64_2);
+    int r = next___open64_2(path, flags);
+    trace_open(AT_FDCWD, path, flags, r);
+    return r;
+}
+
+int
+__openat_2(int dirfd, const char *path, int flags)
+{
+    NEXT(__openat_2);
+    int r = next___openat_2(dirfd, path, flags);
+    trace_open(dirfd, path, flags, r);
+    return r;
+}
+
+int
+__openat64_2(int dirfd, const char *path, int flags)
+{
+    NEXT(__openat64_2);
+    int r = next___openat64_2(dirfd, path, flags);
+    trace_open(dirfd, path, flags, r);
+    return r;
+}
+
+static int
+fopen_flags(const char *mode)
+{
+    return *mode == 'r' && !strchr(mode, '+') ? O_RDONLY : O_WRONLY;
+}
+
+FILE *
+fopen(const char *path, const char *mode)
+{
+    NEXT(fopen);
+    FILE *f = next_fopen(path, mode);
+    trace_open(AT_FDCWD, path, fopen_flags(mode), f ? 0 : -1);
+    return f;
+}
+
+FILE *
+fopen64(const char *path, const char *mode)
+{
+    NEXT(fopen64);
+    FILE *f = next_fopen64(path, mode);
+    trace_open(AT_FDCWD, path, fopen_flags(mode), f ? 0 : -1);
+    return f;
+}
+
+// probes: only the misses are reported
+
+int
+access(const char *path, int amode)
+{
+    NEXT(access);
+    int r = next_access(path, amode);
+    trace_probe(AT_FDCWD, path, r);
+    return r;
+}
+
+int
+faccessat(int dirfd, const char *path, int amode, int flags)
+{
+    NEXT(faccessat);
+    int r = next_faccessat(dirfd, path, amode, flags);
+    trace_probe(dirfd, path, r);
+    return r;
+}
+
+int
+stat(const char *path, struct stat *st)
+{
+    NEXT(stat);
+    int r = next_stat(path, st);
+    trace_probe(AT_FDCWD, path, r);
+    return r;
+}
+
+int
+lstat(const char *path, struct stat *st)
+{
+    NEXT(lstat);
+    int r = next_lstat(path, st);
+    trace_probe(AT_FDCWD, path, r);
+    return r;
+}
+
+int
+fstatat(int dirfd, const char *path, struct stat *st, int flags)
+{
+    NEXT(fstatat);
+    int r = next_fstatat(dirfd, path, st, flags);
+    if (!(flags & AT_EMPTY_PATH) || *path)
+	trace_probe(dirfd, path, r);
+    return r;
+}
+
+int
+stat64(const char *path, struct stat64 *st)
+{
+    NEXT(stat64);
+    int r = next_stat64(path, st);
+    trace_probe(AT_FDCWD, path, r);
+    return r;
+}
+
+int
+lstat64(const char *path, struct stat64 *st)
+{
+    NEXT(lstat64);
+    int r = next_lstat64(path, st);
+    trace_probe(AT_FDCWD, path, r);
+    return r;
+}
+
+int
+fstatat64(int dirfd, const char *path, struct stat64 *st, int flags)
+{
+    NEXT(fstatat64);
+    int r = next_fstatat64(dirfd, path, st, flags);
+    if (!(flags & AT_EMPTY_PATH) || *path)
+	trace_probe(dirfd, path, r);
+    return r;
+}
+
+// coreutils since 8.32 stat files with statx()
+#ifdef STATX_BASIC_STATS
+int
+statx(int dirfd, const char *path, int flags, unsigned int mask, struct statx *stx)
+{
+    NEXT(statx);
+    int r = next_statx(dirfd, path, flags, mask, stx);
+    if (!(flags & AT_EMPTY_PATH) || *path)
+	trace_probe(dirfd, path, r);
+    return r;
+}
+#endif
+
+// glibc before 2.33 calls these from stat() and friends
+int __xstat(int ver, const char *path, struct stat *st);
+int __lxstat(int ver, const char *path, struct stat *st);
+int __xstat64(int ver, const char *path, struct stat64 *st);
+int __lxstat64(int ver, const char *path, struct stat64 *st);
+
+int
+__xstat(int ver, const char *path, struct stat *st)
+{
+    NEXT(__xstat);
+    int r = next___xstat(ver, path, st);
+    trace_probe(AT_FDCWD, path, r);
+    return r;
+}
+
+int
+__lxstat(int ver, const char *path, struct stat *st)
+{
+    NEXT(__lxstat);
+    int r = next___lxstat(ver, path, st);
+    trace_probe(AT_FDCWD, path, r);
+    return r;
+}
+
+int
+__xstat64(int ver, const char *path, struct stat64 *st)
+{
+    NEXT(__xstat64);
+    int r = next___xstat64(ver, path, st);
+    trace_probe(AT_FDCWD, path, r);
+    return r;
+}
+
+int
+__lxstat64(int ver, const char *path, struct stat64 *st)
+{
+    NEXT(__lxstat64);
+    int r = next___lxstat64(ver, path, st);
+    trace_probe(AT_FDCWD, path, r);
+    return r;
+}
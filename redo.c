@@ -1,5 +1,9 @@
 /* An implementation of the redo build system
-   in portable C with zero dependencies
+   in portable C, needing POSIX threads and the __sync builtins of gcc
+
+   Linux interfaces (io_uring, O_TMPFILE, open file description locks,
+   /proc/self/exe, /proc/PID/fd, SO_PEERCRED) are used where they are
+   found, with POSIX fallbacks elsewhere.
 
    Originally from: https://github.com/leahneukirchen/redo-c
 
@@ -13,26 +17,66 @@
 */
 /*
   Note: infinite dependency loops exhaust file descriptors.
-
-  todo:
-  test job server properly
 */
 
+#include <sys/mman.h>
 #include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_URING
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/sched.h>)
+#define HAVE_CLONE
+#include <linux/sched.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+// glibc only defines O_TMPFILE for _GNU_SOURCE
+#if !defined(O_TMPFILE) && defined(__O_TMPFILE)
+#define O_TMPFILE (__O_TMPFILE | O_DIRECTORY)
+#endif
+
+// nor the open file description locks, see live_lock()
+#if defined(__linux__) && !defined(F_OFD_SETLK)
+#define F_OFD_GETLK 36
+#define F_OFD_SETLK 37
+#define F_OFD_SETLKW 38
+#endif
+
 static const char version[] = "0.7";
 
 // ----------------------------------------------------------------------
@@ -44,6 +88,8 @@ int poolrd_fd = -1;
 int level = -1;
 int implicit_jobs = 1;
 int kflag, jflag, xflag, fflag, vflag, dflag;
+int tmpfile_out;   // REDO_TMPFILE: 1 anonymous dep files, 2 and outputs
+extern char **environ;
 
 //                                      1234567890123456
 static const char redo_siphash_key[] = "redo siphash key";
@@ -115,6 +161,19 @@ envfd(const char *name)
     return fd;
 }
 
+// non-negative integer from environment variable, -1 if unset
+static int
+envint(const char *name)
+{
+    char *s = getenv(name);
+    long i;
+
+    if (!s)
+	return -1;
+    i = strtol(s, 0, 10);
+    return i < 0 || i > INT_MAX ? -1 : i;
+}
+
 // set environment variable to integer
 static void
 setenvfd(const char *name, int i)
@@ -138,6 +197,39 @@ rename_temp(const char *old, const char *new)
     if(rename(old, new)) err3("rename", old, new);
 }
 
+// open an anonymous file in directory dir, -1 if the file system
+// does not support it
+static int
+open_tmpfile(const char *dir, int flags, mode_t mode)
+{
+#ifdef O_TMPFILE
+    return open(dir, O_TMPFILE | O_RDWR | flags, mode);
+#else
+    (void)dir; (void)flags; (void)mode;
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+// give the anonymous file fd the name path.  An existing path is
+// replaced by linking to temp first, which must be on the same file
+// system, and renaming it.
+static void
+link_tmpfile(int fd, const char *temp, const char *path)
+{
+    char proc[64];
+
+    snprintf(proc, sizeof proc, "/proc/self/fd/%d", fd);
+    if (linkat(AT_FDCWD, proc, AT_FDCWD, path, AT_SYMLINK_FOLLOW) == 0)
+	return;
+    if (errno != EEXIST ||
+	linkat(AT_FDCWD, proc, AT_FDCWD, temp, AT_SYMLINK_FOLLOW) != 0) {
+	err3("link", proc, path);
+	return;
+    }
+    rename_temp(temp, path);
+}
+
 // retrieve "current directory" handle.  Stored into global dir_fd.
 static int
 keepdir()
@@ -151,770 +243,5386 @@ keepdir()
 }
 
 
-// job manager
+// state shared by all redo processes of a build
 
-void
-vacate(int implicit)
-{
-    if (implicit)
-	implicit_jobs++;
-    else
-	write(poolwr_fd, "\0", 1);
-}
+/*
+  The top-level redo creates a small shared memory region: an
+  unlinked file, passed down as REDO_SHM_FD like the pool pipe, and
+  mapped by every redo process.  Fields are only changed with atomic
+  operations.
+*/
 
-struct job {
-    struct job *next;
-    pid_t pid;
-    int lock_fd;
-    char *target, *temp_depfile, *temp_target;
-    int implicit;
+#define SHARED_SLOTS 1024
+#define POOLS 16         // named pools, see redo_pool()
+#define POOL_NAME 32
+#define VERIFIED 65536   // files verified, see verified_put()
+
+// resource usage of a job, see job_usage()
+struct usage {
+    int64_t user, sys;          // CPU time, microseconds
+    int64_t inblock, oublock;   // block I/O operations
+    int64_t maxrss;             // KiB
+    int64_t wall;               // microseconds
 };
-struct job *jobhead;
+
+// build metrics, see metrics_exit()
+enum {
+    M_CHECKED, M_UPTODATE, M_REBUILT, M_FAILED, M_DEP_LINES,
+    M_STATS, M_CACHE_HITS, M_CACHE_MISSES, M_HASHED, M_HASHED_BYTES,
+    M_DOFILE_PROBES, M_TOKEN_WAITS, M_TOKEN_WAIT_NS, M_LOCK_WAITS,
+    M_LOCK_WAIT_NS, M_FORKS, M_SPAWN_NS, M_GIT_HASHES, M_VERIFIED_HITS, M_PROCESSES,
+    METRICS
+};
+static int64_t metric[METRICS];   // of this process
+#define count(m, n) __sync_fetch_and_add(&metric[m], (n))
+
+struct shared {
+    int hold;      // tokens to hold back, see throttle()
+    int held;      // tokens held back
+    int jobs;      // REDO_JOBS_AUDIT: the limit
+    int running;   // .do files running and not waiting for redo-ifchange
+    int peak;
+    int errors;    // times running exceeded jobs
+    struct {
+	pid_t pid;      // of the .do file, 0 if free
+	pid_t holder;   // redo-ifchange which borrowed it, 0 if none
+	struct usage deps;   // of jobs run by its redo-ifchange calls
+	unsigned pools;      // pool tokens held for it, a bit per pool
+	int calls;           // of redo-ifchange, see verified_start()
+	int ledger;          // of the redo which started it, -1 none
+    } slot[SHARED_SLOTS];
+    int tokens_out;   // pool tokens taken by redo processes
+    int tokens_peak;
+    int recovered;    // tokens returned for dead processes
+    struct {
+	pid_t pid;      // redo process, 0 if free, see live_lock()
+	int tokens;     // pool tokens it holds
+    } ledger[SHARED_SLOTS];
+    int64_t metrics[METRICS];   // of the processes which exited
+    int pool_lock;   // its byte is locked while declaring a pool
+    struct {
+	char name[POOL_NAME];   // "" if unused
+	int size;
+	int free;               // tokens left
+    } pool[POOLS];
+    dev_t sync_dev;   // REDO_DURABILITY=batch: file system of the build
+    int sync_all;     // outputs were written to others
+    struct {
+	uint64_t key;     // first half of the key, 0 if free
+	uint64_t check;   // second half
+	uint64_t dirs;    // directories its check looked into, a bit each
+	int seq;          // set last, 0 while written, see verified_put()
+    } verified[VERIFIED];
+    int verified_seq;          // changes of directories so far
+    int verified_bumped[64];   // verified_seq at the last one, per bit
+    dev_t verified_dev;        // top directory of the build
+    ino_t verified_ino;
+};
+static struct shared *shared;
+static int shared_fd = -1;
+static int pool_tokens;      // tokens put into the pool, 0 if not ours
+static int shared_owner;     // we created it
+static int my_slot = -1;     // REDO_SLOT: slot of the .do file calling us
+static int jobs_audit;       // REDO_JOBS_AUDIT
+
+// build sessions
+
+/*
+  A target which calls redo-always is rebuilt once per build, not each
+  time a redo process of the build reaches it.  The redo which starts
+  a build, and creates the shared region, names it with REDO_SESSION,
+  inherited by all processes below it.  redo-always adds the name to
+  its '!' line, which check_target() takes as satisfied during the
+  same session.  A build of its own, without REDO_SHM_FD, is a new
+  session, but for the redo calls of a job on a worker, which belong
+  to the build which sent it.  See also always_build() and
+  always_unchanged().
+*/
 
 static void
-insert_job(struct job *job)
+session_start()
 {
-    job->next = jobhead;
-    jobhead = job;
+    char id[64];
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    snprintf(id, sizeof id, "%llx.%lx.%d", (long long)ts.tv_sec, (long)ts.tv_nsec, (int)getpid());
+    setenv("REDO_SESSION", id, 1);
 }
 
 static void
-remove_job(struct job *job)
+shared_setup()
 {
-    if (jobhead == job)
-	jobhead = jobhead->next;
-    else {
-	struct job *j = jobhead;
-	while (j->next != job)
-	    j = j->next;
-	j->next = j->next->next;
+    char path[PATH_MAX];
+    const char *tmp = getenv("TMPDIR");
+    int fd = envfd("REDO_SHM_FD");
+
+    if (fd < 0) {
+	if (!getenv("REDO_WORKER") || !getenv("REDO_SESSION"))
+	    session_start();
+	snprintf(path, sizeof path, "%s/redo.shm.XXXXXX", tmp && *tmp ? tmp : "/tmp");
+	if ((fd = mkstemp(path)) < 0)
+	    return;
+	unlink(path);
+	if (ftruncate(fd, sizeof *shared) < 0) {
+	    close(fd);
+	    return;
+	}
+	setenvfd("REDO_SHM_FD", fd);
+	shared_owner = 1;
     }
+    shared = mmap(0, sizeof *shared, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shared == MAP_FAILED)
+	shared = 0;
+    else
+	shared_fd = fd;
 }
 
-static struct job *
-find_job(pid_t pid)
+// atomically take one from *counter if it is positive
+static int
+shared_take(int *counter)
 {
-    struct job *j;
-
-    for (j = jobhead; j; j = j->next) {
-	if (j->pid == pid)
-	    return j;
-    }
-
+    int n;
+    while ((n = *(volatile int *)counter) > 0)
+	if (__sync_bool_compare_and_swap(counter, n, n - 1))
+	    return 1;
     return 0;
 }
 
+// liveness locks
 
-static int
-try_procure()
-{
-    if (implicit_jobs > 0) {
-	implicit_jobs--;
-	return 1;
-    } else {
-	if (poolrd_fd < 0)
-	    return 0;
-
-	fcntl(poolrd_fd, F_SETFL, O_NONBLOCK);
+/*
+  Whether a redo process is still there is told by fcntl() locks on
+  bytes of the shared file, not by its pid, which may have been reused:
+  a lock goes away with the process holding it, however it dies.
+  Where there are open file description locks (Linux), each redo
+  process locks through a description of its own, which its .do files
+  inherit: its lock is held until they have exited too.  Elsewhere the
+  lock is released when the redo process dies, even if its .do files
+  are still running.
+*/
 
-	char buf[1];
-	return read(poolrd_fd, &buf, 1) > 0;
-    }
-}
+static int live_fd = -1;   // the shared file, see live_open()
+static int live_ofd;       // live_fd is a description of our own
 
-static int
-procure()
+static void
+live_open()
 {
-    if (implicit_jobs > 0) {
-	implicit_jobs--;
-	return 1;
-    } else {
-	fcntl(poolrd_fd, F_SETFL, 0);   // clear O_NONBLOCK
+#ifdef F_OFD_SETLK
+    char path[64];
+    int fd;
+#endif
 
-	char buf[1];
-	return read(poolrd_fd, &buf, 1) > 0;
+    if (live_fd >= 0 || shared_fd < 0)
+	return;
+    live_fd = shared_fd;
+#ifdef F_OFD_SETLK
+    // opening it anew, the /dev/fd of Linux does not dup()
+    snprintf(path, sizeof path, "/dev/fd/%d", shared_fd);
+    if ((fd = open(path, O_RDWR)) >= 0) {
+	live_fd = fd;
+	live_ofd = 1;
     }
+#endif
 }
 
-void
-create_pool()
+// lock (F_SETLK, F_SETLKW) the byte of the shared file at off with
+// type F_WRLCK or F_UNLCK, or test (F_GETLK) if another process holds
+// it.  -1 on error.
+static int
+live_lock(int cmd, int type, size_t off)
 {
-    poolrd_fd = envfd("REDO_RD_FD");
-    poolwr_fd = envfd("REDO_WR_FD");
-    if (poolrd_fd < 0 || poolwr_fd < 0) {
-	int jobs = envfd("JOBS");
-	if (jobs > 1) {
-	    int i, fds[2];
-	    if(pipe(fds)) die("no pipes for pool", 100);
-	    poolrd_fd = fds[0];
-	    poolwr_fd = fds[1];
-
-	    for (i = 0; i < jobs-1; i++)
-		vacate(0);
-
-	    setenvfd("REDO_RD_FD", poolrd_fd);
-	    setenvfd("REDO_WR_FD", poolwr_fd);
-	} else {
-	    poolrd_fd = -1;
-	    poolwr_fd = -1;
-	}
-    }
+    struct flock fl;
+    int get = cmd == F_GETLK;
+
+    live_open();
+    memset(&fl, 0, sizeof fl);
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = off;
+    fl.l_len = 1;
+#ifdef F_OFD_SETLK
+    if (live_ofd)
+	cmd = cmd == F_SETLK ? F_OFD_SETLK : cmd == F_SETLKW ? F_OFD_SETLKW : F_OFD_GETLK;
+#endif
+    if (live_fd < 0 || fcntl(live_fd, cmd, &fl) < 0)
+	return -1;
+    return get ? fl.l_type != F_UNLCK : 0;
 }
 
-// orig redo-c uses 256 bit/64 chars sha
-// we use 128 bit/32 chars siphash, 128 bit = 16 byte
-#define HASH_CHARS 32
-
-// https://github.com/veorq/SipHash, CC0 //
-
-/* SipHash-2-4-128 */
-#define cROUNDS 2
-#define dROUNDS 4
-
-#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+// metrics
 
-#define U32TO8_LE(p, v) (p)[0] = (uint8_t)((v)); (p)[1] = (uint8_t)((v) >> 8); (p)[2] = (uint8_t)((v) >> 16); (p)[3] = (uint8_t)((v) >> 24);
+/*
+  With REDO_METRICS=FILE every redo process counts what it does in
+  metric[] and adds it to struct shared when it exits.  The top-level
+  redo, which exits last, writes the sums to FILE: as JSON if its name
+  ends in .json, otherwise in the Prometheus text format, for the
+  textfile collector of node_exporter.  The file is replaced
+  atomically.
+*/
 
-#define U64TO8_LE(p, v) U32TO8_LE((p), (uint32_t)((v)));  U32TO8_LE((p) + 4, (uint32_t)((v) >> 32));
+static const struct {
+    const char *name, *help;
+} metric_info[METRICS] = {
+    { "targets_checked", "Targets whose dependencies were checked" },
+    { "targets_uptodate", "Targets found up to date" },
+    { "targets_rebuilt", ".do files run" },
+    { "targets_failed", ".do files which failed" },
+    { "dep_lines_parsed", "Lines of dep files parsed" },
+    { "stats", "Time stamps of dependencies fetched" },
+    { "check_cache_hits", "Lookups of files already checked by the same process" },
+    { "check_cache_misses", "Lookups of files not yet checked by the same process" },
+    { "files_hashed", "Files hashed" },
+    { "bytes_hashed", "Bytes hashed" },
+    { "dofile_probes", "Names probed for .do files" },
+    { "token_waits", "Times a job had to wait for a job token" },
+    { "token_wait_seconds", "Time spent waiting for job tokens" },
+    { "lock_waits", "Times a target was locked by another redo" },
+    { "lock_wait_seconds", "Time spent waiting for locked targets" },
+    { "forks", "Processes started" },
+    { "spawn_seconds", "Time spent starting processes" },
+    { "git_index_hashes", "Hashes known by the git object ID of a file" },
+    { "verified_hits", "Files found verified by another redo process" },
+    { "processes", "redo processes which took part" },
+};
 
-#define U8TO64_LE(p) (((uint64_t)((p)[0])) | ((uint64_t)((p)[1]) << 8) | ((uint64_t)((p)[2]) << 16) | ((uint64_t)((p)[3]) << 24) | ((uint64_t)((p)[4]) << 32) | ((uint64_t)((p)[5]) << 40) | ((uint64_t)((p)[6]) << 48) | ((uint64_t)((p)[7]) << 56))
+static const char *metrics_file;   // REDO_METRICS
+static pid_t metrics_pid;
+static int64_t metrics_start;
 
-#define SIPROUND do { v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); } while (0)
+static int64_t
+monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-// Note: HASH_CHARS=32 for 128 Bit hashes
-uint8_t *siphash2_4_128(const void *in, const size_t inlen, const void *k) {
-    static uint8_t out[16];
-    const unsigned char *ni = (const unsigned char *)in;
-    const unsigned char *kk = (const unsigned char *)k;
+static void
+metrics_write(const int64_t *m, double seconds)
+{
+    char temp[PATH_MAX];
+    int fd, i, json;
+    size_t len = strlen(metrics_file);
+    FILE *f;
 
-    uint64_t v0 = UINT64_C(0x736f6d6570736575);
-    uint64_t v1 = UINT64_C(0x646f72616e646f6d);
-    uint64_t v2 = UINT64_C(0x6c7967656e657261);
-    uint64_t v3 = UINT64_C(0x7465646279746573);
-    uint64_t k0 = U8TO64_LE(kk);
-    uint64_t k1 = U8TO64_LE(kk + 8);
-    uint64_t m;
-    int i;
-    const unsigned char *end = ni + inlen - (inlen % sizeof(uint64_t));
-    const int left = inlen & 7;
-    uint64_t b = ((uint64_t)inlen) << 56;
-    v3 ^= k1;
-    v2 ^= k0;
-    v1 ^= k1;
-    v0 ^= k0;
-    v1 ^= 0xee;
-    for (; ni != end; ni += 8) {
-	m = U8TO64_LE(ni);
-	v3 ^= m;
-	for (i = 0; i < cROUNDS; ++i) SIPROUND;
-	v0 ^= m;
+    snprintf(temp, sizeof temp, "%s.tmp.%d", metrics_file, (int)getpid());
+    if ((fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0 ||
+	!(f = fdopen(fd, "w"))) {
+	perror(temp);
+	return;
     }
-    switch (left) {
-    case 7:	b |= ((uint64_t)ni[6]) << 48; __attribute__ ((fallthrough)); 
-    case 6: b |= ((uint64_t)ni[5]) << 40; __attribute__ ((fallthrough)); 
-    case 5: b |= ((uint64_t)ni[4]) << 32; __attribute__ ((fallthrough)); 
-    case 4: b |= ((uint64_t)ni[3]) << 24; __attribute__ ((fallthrough)); 
-    case 3:	b |= ((uint64_t)ni[2]) << 16; __attribute__ ((fallthrough)); 
-    case 2:	b |= ((uint64_t)ni[1]) << 8; __attribute__ ((fallthrough)); 
-    case 1:	b |= ((uint64_t)ni[0]);	break;
-    case 0:	break;
+    json = len >= 5 && !strcmp(metrics_file + len - 5, ".json");
+    if (json)
+	fprintf(f, "{\n  \"build_seconds\": %.6f", seconds);
+    else
+	fprintf(f, "# HELP redo_build_seconds Wall time of the build\n"
+		"# TYPE redo_build_seconds gauge\n"
+		"redo_build_seconds %.6f\n", seconds);
+    for (i = 0; i < METRICS; i++) {
+	int ns = i == M_TOKEN_WAIT_NS || i == M_LOCK_WAIT_NS || i == M_SPAWN_NS;
+	if (json)
+	    fprintf(f, ",\n  \"%s\": ", metric_info[i].name);
+	else
+	    fprintf(f, "# HELP redo_%s_total %s\n# TYPE redo_%s_total counter\n"
+		    "redo_%s_total ", metric_info[i].name, metric_info[i].help,
+		    metric_info[i].name, metric_info[i].name);
+	if (ns)
+	    fprintf(f, "%.6f", m[i] / 1e9);
+	else
+	    fprintf(f, "%" PRId64, m[i]);
+	if (!json)
+	    fprintf(f, "\n");
     }
-    v3 ^= b;
-    for (i = 0; i < cROUNDS; ++i) SIPROUND;
-    v0 ^= b;
-    v2 ^= 0xee;
-    for (i = 0; i < dROUNDS; ++i) SIPROUND;
-    b = v0 ^ v1 ^ v2 ^ v3;
-    U64TO8_LE(out, b);
-    v1 ^= 0xdd;
-    for (i = 0; i < dROUNDS; ++i) SIPROUND;
-    b = v0 ^ v1 ^ v2 ^ v3;
-    U64TO8_LE(out + 8, b);
-    return out;
+    if (json)
+	fprintf(f, "\n}\n");
+    if (fclose(f) == EOF) {
+	perror(temp);
+	remove_temp(temp);
+	return;
+    }
+    rename_temp(temp, metrics_file);
 }
 
-// Note: HASH_CHARS
-static char *
-hashtohex(uint8_t *hash)
+// add ours to the shared sums, the top-level redo writes them
+static void
+metrics_exit()
 {
-    static char hex[16] = "0123456789abcdef";
-    static char asciihash[HASH_CHARS+1];
-    char *a;
     int i;
-    
-    for (i = 0, a = asciihash; i < HASH_CHARS/2; i++) {
-	*a++ = hex[hash[i] / 16];
-	*a++ = hex[hash[i] % 16];
-    }
-    *a = 0;
 
-    return asciihash;
+    if (getpid() != metrics_pid || !shared)
+	return;   // a forked child, or no build at all
+    count(M_PROCESSES, 1);
+    for (i = 0; i < METRICS; i++)
+	__sync_fetch_and_add(&shared->metrics[i], metric[i]);
+    if (shared_owner)
+	metrics_write(shared->metrics, (monotonic_ns() - metrics_start) / 1e9);
 }
-static uint8_t *
-hashfile(int fd)
+
+static void
+metrics_setup()
 {
-    off_t off = 0;
-    char buf[4096];
-    ssize_t r;
-    uint8_t *hash = siphash_zero;
-    
-    while ((r = pread(fd, buf, sizeof buf, off)) > 0) {
-	hash = siphash2_4_128(buf, r, &redo_siphash_key);
-	off += r;
+    static char buf[2*PATH_MAX];
+    char cwd[PATH_MAX], *s = getenv("REDO_METRICS");
+
+    if (!s || !*s)
+	return;
+    // we change directories while building
+    if (*s != '/' && getcwd(cwd, sizeof cwd)) {
+	snprintf(buf, sizeof buf, "%s/%s", cwd, s);
+	s = buf;
     }
-    return hash;
+    metrics_file = s;
+    metrics_pid = getpid();
+    metrics_start = monotonic_ns();
+    atexit(metrics_exit);
 }
 
-static char *
-datefile(int fd)
-{
-    static char hexdate[17];
-    struct stat st;
+// job slots
 
-    fstat(fd, &st);
-    snprintf(hexdate, sizeof hexdate, "%016" PRIx64, (uint64_t)st.st_ctime);
+/*
+  Every redo process may run one job without a token, its implicit
+  job.  For the top-level redo this is the one job -j allows beyond
+  the tokens in the pool.  A redo-ifchange called by a .do file runs
+  while the .do file waits for it, so it borrows the job slot of the
+  .do file for its implicit job.  Only one may do so: each running
+  .do file has a slot in struct shared, named by REDO_SLOT, which the
+  first redo-ifchange claims and returns when it exits.  Others
+  called at the same time, e.g. in the background, need tokens.  The
+  slot of a redo-ifchange which was killed is taken over once the jobs
+  it started are done too, see live_lock().
+*/
 
-    return hexdate;
+// account for a .do file starting (1) or waiting (-1)
+static void
+audit_running(int n)
+{
+    int now, peak;
+
+    if (!shared || !jobs_audit)
+	return;
+    now = __sync_add_and_fetch(&shared->running, n);
+    while ((peak = shared->peak) < now)
+	if (__sync_bool_compare_and_swap(&shared->peak, peak, now))
+	    break;
+    if (n > 0 && now > shared->jobs) {
+	__sync_fetch_and_add(&shared->errors, 1);
+	fprintf(stderr, "redo: jobs audit: %d jobs running, limit %d [%d]\n",
+		now, shared->jobs, getpid());
+    }
 }
 
-// find/register dofiles
+static int ledger_register();
+static int ledger_alive(pid_t);
+
+// the slot for a .do file run_script() is about to start, which holds
+// the tokens of pools; booked to us until slot_start().  -1 if the
+// table is full, redo-ifchange runs one job anyway.
+static int
+slot_alloc(unsigned pools)
+{
+    pid_t pid = getpid();
+    int i, n;
+
+    if (shared) {
+	for (n = 0, i = pid % SHARED_SLOTS; n < SHARED_SLOTS; n++, i = (i + 1) % SHARED_SLOTS) {
+	    if (__sync_bool_compare_and_swap(&shared->slot[i].pid, 0, pid)) {
+		shared->slot[i].holder = 0;
+		shared->slot[i].pools = pools;
+		shared->slot[i].calls = 0;
+		shared->slot[i].ledger = ledger_register();
+		memset(&shared->slot[i].deps, 0, sizeof shared->slot[i].deps);
+		audit_running(1);
+		return i;
+	    }
+	}
+    }
+    return -1;
+}
 
+// the .do file of slot i was started as pid, or could not be (-1)
 static void
-redo_ifcreate(int fd, char *target)
+slot_start(int i, pid_t pid)
 {
-    dprintf(fd, "-%s\n", target);
+    if (i < 0)
+	return;
+    if (pid > 0) {
+	shared->slot[i].pid = pid;
+	return;
+    }
+    shared->slot[i].pools = 0;
+    shared->slot[i].ledger = -1;
+    shared->slot[i].pid = 0;
+    audit_running(-1);
 }
 
-static char *
-check_dofile(const char *fmt, ...)
+// the job pid was reaped, deps gets the usage of the jobs it waited for
+// and pools the pool tokens it held
+static void
+slot_free(pid_t pid, struct usage *deps, unsigned *pools)
 {
-    static char dofile[PATH_MAX];
+    int i, n;
 
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(dofile, sizeof dofile, fmt, ap);
-    va_end(ap);
+    if (!shared)
+	return;
+    for (n = 0, i = pid % SHARED_SLOTS; n < SHARED_SLOTS; n++, i = (i + 1) % SHARED_SLOTS) {
+	if (shared->slot[i].pid == pid) {
+	    *deps = shared->slot[i].deps;
+	    *pools = __sync_lock_test_and_set(&shared->slot[i].pools, 0);
+	    shared->slot[i].ledger = -1;
+	    shared->slot[i].pid = 0;
+	    audit_running(-1);
+	    return;
+	}
+    }
+}
 
-    if (access(dofile, F_OK) == 0) {
-	return dofile;
-    } else {
-	redo_ifcreate(dep_fd, dofile);
-	return 0;
+// all jobs are done, the .do file continues in its slot
+static void
+slot_return()
+{
+    if (my_slot < 0 || shared->slot[my_slot].holder != getpid())
+	return;   // not ours, or called in a forked child
+    implicit_jobs = 0;
+    audit_running(1);
+    shared->slot[my_slot].holder = 0;
+}
+
+// borrow the slot of the calling .do file for our implicit job
+static void
+slot_claim()
+{
+    static int claimed;
+    pid_t holder;
+
+    if (my_slot < 0 || claimed || implicit_jobs > 0)
+	return;
+    holder = shared->slot[my_slot].holder;
+    if (holder && ledger_alive(holder))
+	return;
+    if (ledger_register() < 0)
+	return;   // ledger full, others could not tell if we are alive
+    if (__sync_bool_compare_and_swap(&shared->slot[my_slot].holder, holder, getpid())) {
+	claimed = 1;
+	implicit_jobs = 1;
+	if (!holder)
+	    audit_running(-1);
+	atexit(slot_return);   // also on the error exits
     }
 }
 
-/*
-  dir/base.a.b
-  will look for dir/base.a.b.do,
-  dir/default.a.b.do, dir/default.b.do, dir/default.do,
-  default.a.b.do, default.b.do, and default.do.
+// named pools
 
-  this function assumes no / in target
+/*
+  Jobs which need more of something than others, like memory for
+  linking, can be limited further than by -j: `redo-pool NAME N` in a
+  .do file declares the pool NAME of N tokens, unless REDO_POOLS
+  ("link=4 lto=1") or an earlier redo-pool did, and waits for a token
+  of it.  The pool is recorded in the dep file, so the next build
+  takes the pool token before run_script(), together with the job
+  token.  Pools are counters in struct shared, as a .do file may
+  declare one when all other redo processes run already; the pool
+  tokens of a .do file are booked in its slot and given back when it
+  is reaped.
+
+  Nobody waits for a pool token while holding one: tokens are taken
+  all at once or none, and the pool tokens of a .do file are lent out
+  while its redo-ifchange waits for jobs, and taken back afterwards.
 */
-static char *
-find_dofile(char *target)
+
+// index of pool name, declared with size tokens if it is not yet; -1
+// if there is no such pool
+static int
+pool_find(const char *name, int size)
 {
-    char updir[PATH_MAX];
-    char *u = updir;
-    char *dofile, *s;
-    struct stat st, ost;
+    int i, unused = -1;
 
-    dofile = check_dofile("./%s.do", target);
-    if (dofile)
-	return dofile;
+    if (!shared || !*name || strlen(name) >= POOL_NAME)
+	return -1;
+    // a lock, unlike a spin on a flag, goes away with a killed holder
+    while (live_lock(F_SETLKW, F_WRLCK, offsetof(struct shared, pool_lock)) < 0 &&
+	   errno == EINTR)
+	;
+    for (i = 0; i < POOLS && strcmp(shared->pool[i].name, name); i++)
+	if (unused < 0 && !*shared->pool[i].name)
+	    unused = i;
+    if (i == POOLS && (i = size > 0 ? unused : -1) >= 0) {
+	strcpy(shared->pool[i].name, name);
+	shared->pool[i].size = shared->pool[i].free = size;
+    }
+    live_lock(F_SETLK, F_UNLCK, offsetof(struct shared, pool_lock));
+    return i;
+}
 
-    *u++ = '.';
-    *u++ = '/';
-    *u = 0;
+static void
+pool_give(unsigned pools)
+{
+    int i;
 
-    st.st_dev = ost.st_dev = st.st_ino = ost.st_ino = 0;
+    for (i = 0; i < POOLS; i++)
+	if (pools & 1u << i)
+	    __sync_fetch_and_add(&shared->pool[i].free, 1);
+}
 
-    while (1) {
-	ost = st;
+// take a token of each of pools, all or none
+static int
+pool_take(unsigned pools)
+{
+    unsigned taken = 0;
+    int i;
 
-	if (stat(updir, &st) < 0)
+    for (i = 0; i < POOLS; i++) {
+	if (!(pools & 1u << i))
+	    continue;
+	if (!shared_take(&shared->pool[i].free)) {
+	    pool_give(taken);
 	    return 0;
-	if (ost.st_dev == st.st_dev && ost.st_ino == st.st_ino)
-	    break;  // reached root dir, .. = .
-
-	// also check ../target.do
-	dofile = check_dofile("%s%s.do", updir, target);
-	if (dofile)
-	    return dofile;
-	s = target;
-	while (*s) {
-	    if (*s++ == '.') {
-		dofile = check_dofile("%sdefault.%s.do", updir, s);
-		if (dofile)
-		    return dofile;
-	    }
 	}
+	taken |= 1u << i;
+    }
+    return 1;
+}
 
-	dofile = check_dofile("%sdefault.do", updir);
-	if (dofile)
-	    return dofile;
+static void
+pool_wait(unsigned pools)
+{
+    while (!pool_take(pools))
+	poll(0, 0, 10);
+}
 
-	*u++ = '.';
-	*u++ = '.';
-	*u++ = '/';
-	*u = 0;
+// REDO_POOLS: pools declared by the top-level redo
+static void
+pool_setup()
+{
+    const char *s = getenv("REDO_POOLS");
+    char name[POOL_NAME];
+    int size, n;
+
+    while (s && sscanf(s, " %31[^=, ]=%d%n", name, &size, &n) == 2) {
+	if (size < 1 || pool_find(name, size) < 0)
+	    err2("REDO_POOLS: cannot declare pool", name);
+	s += n;
+	s += strspn(s, ", ");
     }
+}
 
-    return 0;
+static unsigned pools_lent;   // by the .do file calling us
+
+// the jobs of our redo-ifchange may need the pool tokens of the .do
+// file calling it
+static void
+pool_lend()
+{
+    if (my_slot >= 0 && !pools_lent &&
+	(pools_lent = __sync_lock_test_and_set(&shared->slot[my_slot].pools, 0)))
+	pool_give(pools_lent);
 }
 
-static char *
-targetchdir(char *target)
+static void
+pool_unlend()
 {
-    char *base = strrchr(target, '/');
-    if (base) {
-	int fd;
-	*base = 0;
-	fd = openat(dir_fd, target, O_RDONLY | O_DIRECTORY);
-	if (fd < 0) {
-	    perror("openat dir");
-	    exit(111);
-	}
-	*base = '/';
-	if (fchdir(fd) < 0) {
-	    perror("chdir");
-	    exit(111);
-	}
-	close(fd);
-	return base+1;
-    } else {
-	fchdir(dir_fd);
-	return target;
+    if (!pools_lent)
+	return;
+    pool_wait(pools_lent);
+    __sync_fetch_and_or(&shared->slot[my_slot].pools, pools_lent);
+    pools_lent = 0;
+}
+
+// redo-pool: the .do file calling us runs in pool name
+static void
+redo_pool(const char *name, int size)
+{
+    unsigned held;
+    int i;
+
+    if ((i = pool_find(name, size)) < 0)
+	die2(size > 0 ? "redo-pool: cannot declare pool" : "redo-pool: no such pool", name, 111);
+    dprintf(dep_fd, "%%%s %d\n", name, size);
+    if (my_slot < 0)
+	return;   // slot table full, not booked
+    held = __sync_lock_test_and_set(&shared->slot[my_slot].pools, 0);
+    if (!(held & 1u << i)) {
+	pool_give(held);
+	dprint2("redo-pool: waiting for pool ", name);
+	pool_wait(held | 1u << i);
     }
+    __sync_fetch_and_or(&shared->slot[my_slot].pools, held | 1u << i);
 }
 
-// dependency handling, derived filenames
+// token ledger
 
-void
-check_or_create_dir(const char *path)
+/*
+  Pool tokens return through vacate() only.  A redo process which
+  exits early, or is killed, would take its tokens with it, and the
+  build would continue with fewer jobs.  So every redo process books
+  the tokens it takes in a ledger in struct shared: on exit() they
+  are written back by ledger_exit(), and the pool owner gives back
+  those of processes which died on a signal every second, once the
+  live_lock() of their entry is gone, together with the pool tokens of
+  the .do files they started.
+*/
+
+static int my_ledger = -1;
+static void ledger_exit();
+
+#define LEDGER_LOCK(i) offsetof(struct shared, ledger[i])
+
+// our entry in the ledger, locked before it is ours, so an entry with
+// a pid which is not locked is one of a dead process.  -1 if full.
+static int
+ledger_register()
 {
-    struct stat stats;
-    if (!mkdir(path, 0755)) return;
-    if (errno!=EEXIST) die2("failed to mkdir: ", path, 111);
-    if (stat(path, &stats) && errno != ENOENT) die2("failed to stat: ", path, 111);
-    if (!S_ISDIR(stats.st_mode)) die2("not a directory: ", path, 111);
-    if (access(path, R_OK|W_OK|X_OK)<0) die2("insufficient rights: ", path, 111);
+    static int registered;
+    pid_t pid = getpid();
+    int i, k;
+
+    if (my_ledger >= 0 && shared->ledger[my_ledger].pid == pid)
+	return my_ledger;
+    my_ledger = -1;
+    for (k = 0, i = pid % SHARED_SLOTS; k < SHARED_SLOTS; k++, i = (i + 1) % SHARED_SLOTS) {
+	if (shared->ledger[i].pid || live_lock(F_SETLK, F_WRLCK, LEDGER_LOCK(i)) < 0)
+	    continue;
+	if (__sync_bool_compare_and_swap(&shared->ledger[i].pid, 0, pid)) {
+	    my_ledger = i;
+	    break;
+	}
+	live_lock(F_SETLK, F_UNLCK, LEDGER_LOCK(i));
+    }
+    if (my_ledger >= 0 && !registered++)
+	atexit(ledger_exit);
+    return my_ledger;
 }
 
-static const char *
-redo_base(char *target)
+// whether the registered redo process pid, or its .do files, still run
+static int
+ledger_alive(pid_t pid)
 {
-    static const char *redo_base = ".redo";
-    (void)target;
-    return redo_base;
+    int i;
+
+    if (pid == getpid())
+	return 1;
+    for (i = 0; i < SHARED_SLOTS; i++)
+	if (shared->ledger[i].pid == pid)
+	    return live_lock(F_GETLK, F_WRLCK, LEDGER_LOCK(i)) != 0;
+    return 0;
 }
 
-static char *
-targetdep(char *target)
+// write n tokens back to the pool on behalf of a dead holder
+static void
+ledger_recover(int i, int n)
 {
-    static char buf[PATH_MAX];
-    snprintf(buf, sizeof buf, ".redo/%s.dep", target);
-    return buf;
+    if (n > 0) {
+	__sync_fetch_and_add(&shared->recovered, n);
+	__sync_fetch_and_sub(&shared->tokens_out, n);
+	while (n-- > 0)
+	    write(poolwr_fd, "\0", 1);
+    }
+    shared->ledger[i].tokens = 0;
+    shared->ledger[i].pid = 0;
 }
 
-static char *
-targetlock(char *target)
+static void
+ledger_exit()
 {
-    static char buf[PATH_MAX];
-    snprintf(buf, sizeof buf, ".redo/%s.lock", target);
-    return buf;
+    if (my_ledger >= 0 && shared->ledger[my_ledger].pid == getpid()) {
+	ledger_recover(my_ledger, shared->ledger[my_ledger].tokens);
+	live_lock(F_SETLK, F_UNLCK, LEDGER_LOCK(my_ledger));
+    }
 }
 
-static char *
-targettmp(const char *prefix, unsigned int id, const char *target)
+// book n tokens taken (or given back, if negative) by this process
+static void
+ledger_add(int n)
 {
-    static char buf[PATH_MAX];
-    snprintf(buf, sizeof buf, ".redo/%s.%u.%s", prefix, id, target);
-    return buf;
+    int now, peak;
+
+    if (!shared)
+	return;
+    now = __sync_add_and_fetch(&shared->tokens_out, n);
+    while ((peak = shared->tokens_peak) < now)
+	if (__sync_bool_compare_and_swap(&shared->tokens_peak, peak, now))
+	    break;
+
+    if (ledger_register() < 0)
+	return;   // ledger full, not tracked
+    __sync_fetch_and_add(&shared->ledger[my_ledger].tokens, n);
 }
 
-// return false:
-// - when target dependency files exists
-// - or when dofile for target is not found
-static int
-sourcefile(char *target)
+// pool owner: recover the tokens of processes killed by a signal
+static void
+ledger_reclaim()
 {
-    // return 0 if target dependency file exists
-    if (access(targetdep(target), F_OK) == 0)
-	return 0;
+    pid_t pid;
+    int i, k, saved_errno = errno;
+
+    for (i = 0; i < SHARED_SLOTS; i++) {
+	pid = shared->ledger[i].pid;
+	if (pid <= 0 || ledger_alive(pid) ||
+	    !__sync_bool_compare_and_swap(&shared->ledger[i].pid, pid, -1))
+	    continue;
+	if (shared->ledger[i].tokens > 0)
+	    fprintf(stderr, "redo: recovered %d job tokens of dead process %d\n",
+		    shared->ledger[i].tokens, pid);
+	// and the pool tokens of the .do files it started, which are gone
+	for (k = 0; k < SHARED_SLOTS; k++) {
+	    if (shared->slot[k].ledger != i || !shared->slot[k].pid)
+		continue;
+	    pool_give(__sync_lock_test_and_set(&shared->slot[k].pools, 0));
+	    shared->slot[k].ledger = -1;
+	    shared->slot[k].pid = 0;
+	    audit_running(-1);
+	}
+	ledger_recover(i, shared->ledger[i].tokens);
+    }
+    errno = saved_errno;
+}
 
-    // Note: fflag.. REDO_FORCE, never set to negative value!
-    // return 0 if target does not exist
-    if (fflag < 0)
-	return access(target, F_OK) == 0;
+// the top-level redo reports the most jobs seen running and tokens used
+static void
+audit_report()
+{
+    if (!shared || !shared_owner)
+	return;
+    if (pool_tokens) {
+	ledger_reclaim();
+	if (dflag || shared->recovered)
+	    fprintf(stderr, "redo: job tokens: %d, at most %d in use, %d leaked and recovered\n",
+		    pool_tokens, shared->tokens_peak, shared->recovered);
+    }
+    if (!jobs_audit)
+	return;
+    fprintf(stderr, "redo: jobs audit: at most %d of %d jobs running\n",
+	    shared->peak, shared->jobs);
+    // all tokens are back in the pool, but those throttle() holds
+    if (pool_tokens) {
+	char buf[64];
+	int n = 0, i;
+	ssize_t r;
 
-    // return 0 if dofile for target is not found
-    return find_dofile(target) == 0;
+	fcntl(poolrd_fd, F_SETFL, O_NONBLOCK);
+	while ((r = read(poolrd_fd, buf, sizeof buf)) > 0)
+	    n += r;
+	for (i = 0; i < n; i++)
+	    write(poolwr_fd, "\0", 1);
+	if (n != pool_tokens - shared->held) {
+	    fprintf(stderr, "redo: jobs audit: %d of %d job tokens back in the pool\n",
+		    n, pool_tokens - shared->held);
+	    shared->errors++;
+	}
+    }
+    if (shared->errors)
+	exit(111);
 }
 
-// Note: HASH_CHARS depend on hash, and changes .dep file format
-// return true when target does not need a rebuild:
-// - if target is a sourcefile
-// - no "false" check succeeds
-// false (0) when:
-// - FORCE_REDO is set (>0)
-// - depfile cannot be opened for reading
-// - error during reading of depfile
-// - '-' line and dependency exists
-// - '=' line:
-//    - dependency cannot be opened for reading
-//    - timestamp or hash does not match
-//    - all dependencies are up-to date
-// - '!' line
-// - any other character on first position of line
-static int
-check_deps(char *target)
+// nothing to wait for but a token or the slot: give them some time
+static void
+slot_wait()
 {
-    char *depfile;
-    FILE *f;
-    int ok = 1;
-    int fd;
-    int old_dir_fd = dir_fd;
+    struct pollfd pfd = { poolrd_fd, POLLIN, 0 };
+    poll(&pfd, poolrd_fd >= 0, 10);
+}
 
-    target = targetchdir(target);
 
-    if (sourcefile(target)) {
-	dprint2("Not rebuilt, is sourcefile: ", target);
-	return 1;
+// job manager
+
+void
+vacate(int implicit)
+{
+    if (implicit) {
+	implicit_jobs++;
+	return;
     }
-    if (fflag > 0) {
-	dprint2("Rebuild, force flag active: ", target);
-	return 0;
+    ledger_add(-1);
+    if (shared && shared_take(&shared->hold))
+	__sync_fetch_and_add(&shared->held, 1);   // throttled
+    else
+	write(poolwr_fd, "\0", 1);
+}
+
+struct job {
+    struct job *next;
+    pid_t pid;
+    int lock_fd;
+    char *target, *temp_depfile, *temp_target;
+    char *deprec;        // dep records of the parent, written on completion
+    int out_fd, dep_fd;  // anonymous files, -1 for named temp files
+    int implicit;
+    unsigned pools;      // pool tokens taken for it
+    int trace_fd;        // REDO_DEPTRACE, -1 if not traced
+    struct timespec start;
+    struct timespec dep_time;   // mtime of the new dep file, see check_target()
+};
+struct job *jobhead;
+
+static void
+insert_job(struct job *job)
+{
+    job->next = jobhead;
+    jobhead = job;
+}
+
+static void
+remove_job(struct job *job)
+{
+    if (jobhead == job)
+	jobhead = jobhead->next;
+    else {
+	struct job *j = jobhead;
+	while (j->next != job)
+	    j = j->next;
+	j->next = j->next->next;
     }
-    
-    depfile = targetdep(target);
-    f = fopen(depfile, "r");
-    if (!f) {
-	dprint2("Rebuild, depfile cannot be opened: ", target);
-	return 0;
+}
+
+static struct job *
+find_job(pid_t pid)
+{
+    struct job *j;
+
+    for (j = jobhead; j; j = j->next) {
+	if (j->pid == pid)
+	    return j;
     }
-    dir_fd = keepdir();
 
-    while (ok && !feof(f)) {
-	char line[4096];
-	char *hash = line + 1;
-	char *timestamp = line + 1 + HASH_CHARS + 1;
-	char *filename = line + 1 + HASH_CHARS + 1 + 16 + 1;
+    return 0;
+}
 
-	if (fgets(line, sizeof line, f)) {
-	    line[strlen(line)-1] = 0; // strip \n
-	    switch (line[0]) {
-	    case '-':  // must not exist
-		if (access(line+1, F_OK) == 0) {
-		    // Note: better message needed
-		    dprint4("Rebuild, dependency ", line+1, " must not exist: ", target);
-		    ok = 0;
-		}
-		break;
-	    case '=':  // compare hash
-		fd = open(filename, O_RDONLY);
-		if (fd < 0) {
-		    dprint4("Rebuild, cannot open dependency ", filename, " for reading: ", target);
-		    ok = 0;
-		} else {
-		    /* if (strncmp(timestamp, datefile(fd), 16) != 0 && */
-		    /* 	strncmp(hash, hashtohex(hashfile(fd)), HASH_CHARS) != 0) */
-		    /* 	ok = 0; */
-		    if (strncmp(timestamp, datefile(fd), 16) != 0) {
-			ok = 0;
-			dprint4("Rebuild, timestamp mismatch for ", filename, ": ", target);
-		    } else if (strncmp(hash, hashtohex(hashfile(fd)), HASH_CHARS) != 0) {
-			ok = 0;
-			dprint4("Rebuild, hash mismatch for ", filename, ": ", target);
-		    }
-		    close(fd);
-		}
-		// hash is good, recurse into dependencies
-		if (ok && strcmp(target, filename) != 0) {
-		    ok = check_deps(filename);
-		    if (!ok)
-			dprint4("Rebuild, dependency needs rebuild for ", filename, ": ", target);
-		    fchdir(dir_fd);
+
+static int
+try_procure()
+{
+    if (implicit_jobs > 0) {
+	implicit_jobs--;
+	return 1;
+    } else {
+	if (poolrd_fd < 0)
+	    return 0;
+
+	fcntl(poolrd_fd, F_SETFL, O_NONBLOCK);
+
+	char buf[1];
+	if (read(poolrd_fd, &buf, 1) <= 0)
+	    return 0;
+	ledger_add(1);
+	return 1;
+    }
+}
+
+void
+create_pool()
+{
+    poolrd_fd = envfd("REDO_RD_FD");
+    poolwr_fd = envfd("REDO_WR_FD");
+    if (poolrd_fd < 0 || poolwr_fd < 0) {
+	int jobs = envfd("JOBS");
+	if (jobs > 1) {
+	    int i, fds[2];
+	    if(pipe(fds)) die("no pipes for pool", 100);
+	    poolrd_fd = fds[0];
+	    poolwr_fd = fds[1];
+
+	    for (i = 0; i < jobs-1; i++)
+		write(poolwr_fd, "\0", 1);
+	    pool_tokens = jobs-1;
+
+	    setenvfd("REDO_RD_FD", poolrd_fd);
+	    setenvfd("REDO_WR_FD", poolwr_fd);
+	} else {
+	    poolrd_fd = -1;
+	    poolwr_fd = -1;
+	}
+    }
+
+    jobs_audit = envfd("REDO_JOBS_AUDIT") > 0;
+    shared_setup();
+    if (shared && shared_owner) {
+	int jobs = envfd("JOBS");
+	shared->jobs = jobs > 1 ? jobs : 1;
+	pool_setup();
+    }
+    // a .do file called us: our implicit job is the one of the .do file
+    if (shared && (my_slot = envint("REDO_SLOT")) >= SHARED_SLOTS)
+	my_slot = -1;
+    if (my_slot >= 0)
+	implicit_jobs = 0;
+}
+
+// throttling
+
+/*
+  The redo which created the job pool can hold tokens back while the
+  machine is busy: with -l (REDO_LOAD) while the load average is
+  above the given value, with REDO_PSI while the pressure stall
+  information of cpu, io or memory is above the given percentage.
+  Once a second it takes one more token out of the pool, or, when all
+  are in use, asks for the next one returned to be kept back (in
+  struct shared).  One token is given back once the pressure went
+  below 90% (load) or half (PSI) of the limit.  Stalls of all tasks
+  on memory hold all tokens back at once, they precede the OOM
+  killer.  With both limits, holding back wins: tokens are only given
+  back when neither is near its limit.  The implicit job of each redo
+  remains, so the build never stops.
+*/
+
+static double load_max, psi_max;
+static volatile sig_atomic_t ticked;
+
+static void
+tick(int sig)
+{
+    (void)sig;
+    ticked = 1;
+}
+
+// avg10 of the "some" or "full" line of /proc/pressure/what, -1 if unknown
+static double
+psi_read(const char *what, const char *kind)
+{
+    char path[64], line[256];
+    double avg = -1;
+    FILE *f;
+
+    snprintf(path, sizeof path, "/proc/pressure/%s", what);
+    if (!(f = fopen(path, "r")))
+	return -1;
+    while (fgets(line, sizeof line, f))
+	if (!strncmp(line, kind, strlen(kind)))
+	    sscanf(line + strlen(kind), " avg10=%lf", &avg);
+    fclose(f);
+    return avg;
+}
+
+// 1 to hold back tokens, 2 to hold back all, -1 to give them back
+static int
+pressure(char *msg, size_t size)
+{
+    double load, cpu, io, mem, memfull, most;
+    int hold = 0, release = 1, known = 0, n = 0;
+
+    *msg = 0;
+    if (load_max > 0 && getloadavg(&load, 1) == 1) {
+	n = snprintf(msg, size, "load %.2f, limit %.2f", load, load_max);
+	if (load > load_max)
+	    hold = 1;
+	if (load >= 0.9 * load_max)
+	    release = 0;
+	known = 1;
+    }
+    if (psi_max > 0) {
+	cpu = psi_read("cpu", "some");
+	io = psi_read("io", "some");
+	mem = psi_read("memory", "some");
+	memfull = psi_read("memory", "full");
+	most = cpu > io ? cpu : io;
+	most = mem > most ? mem : most;
+	most = memfull > most ? memfull : most;
+	if (n >= 0 && (size_t)n < size)
+	    snprintf(msg + n, size - n, "%spressure cpu %.2f io %.2f memory %.2f/%.2f, limit %.2f",
+		     n ? "; " : "", cpu, io, mem, memfull, psi_max);
+	if (memfull > psi_max)
+	    hold = 2;
+	else if (most > psi_max && !hold)
+	    hold = 1;
+	if (most >= psi_max / 2)
+	    release = 0;
+	if (most >= 0)
+	    known = 1;
+    }
+    if (hold)
+	return hold;
+    return known && release ? -1 : 0;
+}
+
+static void
+throttle_setup()
+{
+    struct sigaction sa;
+    struct itimerval it = { { 1, 0 }, { 1, 0 } };
+    char *s;
+
+    if (!pool_tokens || !shared)
+	return;
+    if ((s = getenv("REDO_LOAD")))
+	load_max = strtod(s, 0);
+    if ((s = getenv("REDO_PSI")))
+	psi_max = strtod(s, 0);
+
+    // no SA_RESTART: the tick interrupts waiting for jobs
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = tick;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGALRM, &sa, 0);
+    setitimer(ITIMER_REAL, &it, 0);
+}
+
+static void
+throttle_stop()
+{
+    struct itimerval it = { { 0, 0 }, { 0, 0 } };
+
+    if (pool_tokens && shared)
+	setitimer(ITIMER_REAL, &it, 0);
+}
+
+static void
+throttle()
+{
+    char buf[1], msg[256] = "";
+    int p, before, saved_errno = errno;
+
+    if (!ticked || !shared)
+	return;
+    ticked = 0;
+
+    ledger_reclaim();
+    if (load_max <= 0 && psi_max <= 0) {
+	errno = saved_errno;
+	return;
+    }
+
+    before = shared->held + shared->hold;
+    p = pressure(msg, sizeof msg);
+    if (p > 0) {
+	// take an idle token, or have the next returned one kept
+	fcntl(poolrd_fd, F_SETFL, O_NONBLOCK);
+	do {
+	    if (shared->held + shared->hold >= pool_tokens)
+		break;
+	    if (read(poolrd_fd, buf, 1) > 0)
+		__sync_fetch_and_add(&shared->held, 1);
+	    else
+		__sync_fetch_and_add(&shared->hold, 1);
+	} while (p == 2);
+    } else if (p < 0) {
+	// cancel a pending hold, or give a token back
+	if (!shared_take(&shared->hold) && shared_take(&shared->held))
+	    write(poolwr_fd, "\0", 1);
+    }
+    if (dflag && shared->held + shared->hold != before)
+	fprintf(stderr, "throttle: %s, holding back %d of %d tokens (%d pending)\n",
+		msg, shared->held + shared->hold, pool_tokens, shared->hold);
+    errno = saved_errno;   // of waitpid()
+}
+
+// scheduling delays
+
+/*
+  REDO_JITTER=N sleeps up to N microseconds, at random, where the
+  processes of a parallel build race each other: before a job token
+  is taken, before a target is locked, and before a finished job is
+  committed.  It shakes out orderings an idle machine rarely shows,
+  for the stress tests of t/stress.do; a build is not meant to run
+  with it.
+*/
+
+static int jitter_max;   // REDO_JITTER
+static uint64_t jitter_state;
+
+static void
+setup_jitter()
+{
+    if ((jitter_max = envint("REDO_JITTER")) <= 0)
+	return;
+    jitter_state = ((uint64_t)getpid() << 32 ^ monotonic_ns()) | 1;
+}
+
+static void
+jitter()
+{
+    struct timespec ts;
+    int saved_errno = errno;
+
+    if (jitter_max <= 0)
+	return;
+    // xorshift64, a new sequence in each process
+    jitter_state ^= jitter_state << 13;
+    jitter_state ^= jitter_state >> 7;
+    jitter_state ^= jitter_state << 17;
+    ts.tv_sec = 0;
+    ts.tv_nsec = jitter_state % ((uint64_t)jitter_max + 1) * 1000;
+    while (ts.tv_nsec >= 1000000000) {
+	ts.tv_sec++;
+	ts.tv_nsec -= 1000000000;
+    }
+    nanosleep(&ts, 0);
+    errno = saved_errno;
+}
+
+// orig redo-c uses 256 bit/64 chars sha
+// we use 128 bit/32 chars siphash, 128 bit = 16 byte
+#define HASH_CHARS 32
+
+// https://github.com/veorq/SipHash, CC0 //
+
+/* SipHash-2-4-128 */
+#define cROUNDS 2
+#define dROUNDS 4
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define U32TO8_LE(p, v) (p)[0] = (uint8_t)((v)); (p)[1] = (uint8_t)((v) >> 8); (p)[2] = (uint8_t)((v) >> 16); (p)[3] = (uint8_t)((v) >> 24);
+
+#define U64TO8_LE(p, v) U32TO8_LE((p), (uint32_t)((v)));  U32TO8_LE((p) + 4, (uint32_t)((v) >> 32));
+
+#define U8TO64_LE(p) (((uint64_t)((p)[0])) | ((uint64_t)((p)[1]) << 8) | ((uint64_t)((p)[2]) << 16) | ((uint64_t)((p)[3]) << 24) | ((uint64_t)((p)[4]) << 32) | ((uint64_t)((p)[5]) << 40) | ((uint64_t)((p)[6]) << 48) | ((uint64_t)((p)[7]) << 56))
+
+#define SIPROUND do { v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); } while (0)
+
+// Note: HASH_CHARS=32 for 128 Bit hashes
+// writes the hash to out, which is returned
+uint8_t *siphash2_4_128_r(const void *in, const size_t inlen, const void *k, uint8_t *out) {
+    const unsigned char *ni = (const unsigned char *)in;
+    const unsigned char *kk = (const unsigned char *)k;
+
+    uint64_t v0 = UINT64_C(0x736f6d6570736575);
+    uint64_t v1 = UINT64_C(0x646f72616e646f6d);
+    uint64_t v2 = UINT64_C(0x6c7967656e657261);
+    uint64_t v3 = UINT64_C(0x7465646279746573);
+    uint64_t k0 = U8TO64_LE(kk);
+    uint64_t k1 = U8TO64_LE(kk + 8);
+    uint64_t m;
+    int i;
+    const unsigned char *end = ni + inlen - (inlen % sizeof(uint64_t));
+    const int left = inlen & 7;
+    uint64_t b = ((uint64_t)inlen) << 56;
+    v3 ^= k1;
+    v2 ^= k0;
+    v1 ^= k1;
+    v0 ^= k0;
+    v1 ^= 0xee;
+    for (; ni != end; ni += 8) {
+	m = U8TO64_LE(ni);
+	v3 ^= m;
+	for (i = 0; i < cROUNDS; ++i) SIPROUND;
+	v0 ^= m;
+    }
+    switch (left) {
+    case 7:	b |= ((uint64_t)ni[6]) << 48; __attribute__ ((fallthrough)); 
+    case 6: b |= ((uint64_t)ni[5]) << 40; __attribute__ ((fallthrough)); 
+    case 5: b |= ((uint64_t)ni[4]) << 32; __attribute__ ((fallthrough)); 
+    case 4: b |= ((uint64_t)ni[3]) << 24; __attribute__ ((fallthrough)); 
+    case 3:	b |= ((uint64_t)ni[2]) << 16; __attribute__ ((fallthrough)); 
+    case 2:	b |= ((uint64_t)ni[1]) << 8; __attribute__ ((fallthrough)); 
+    case 1:	b |= ((uint64_t)ni[0]);	break;
+    case 0:	break;
+    }
+    v3 ^= b;
+    for (i = 0; i < cROUNDS; ++i) SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xee;
+    for (i = 0; i < dROUNDS; ++i) SIPROUND;
+    b = v0 ^ v1 ^ v2 ^ v3;
+    U64TO8_LE(out, b);
+    v1 ^= 0xdd;
+    for (i = 0; i < dROUNDS; ++i) SIPROUND;
+    b = v0 ^ v1 ^ v2 ^ v3;
+    U64TO8_LE(out + 8, b);
+    return out;
+}
+
+uint8_t *siphash2_4_128(const void *in, const size_t inlen, const void *k) {
+    static _Thread_local uint8_t out[16];
+    return siphash2_4_128_r(in, inlen, k, out);
+}
+
+// Note: HASH_CHARS
+static char *
+hashtohex(uint8_t *hash)
+{
+    static char hex[16] = "0123456789abcdef";
+    static _Thread_local char asciihash[HASH_CHARS+1];
+    char *a;
+    int i;
+    
+    for (i = 0, a = asciihash; i < HASH_CHARS/2; i++) {
+	*a++ = hex[hash[i] / 16];
+	*a++ = hex[hash[i] % 16];
+    }
+    *a = 0;
+
+    return asciihash;
+}
+// each block is hashed with the hash of the previous one as key, the
+// first one with the redo key.  Hashes block buf of length r into the
+// state key, which is also the result.
+static void
+hashblock(uint8_t *key, const char *buf, size_t r)
+{
+    uint8_t out[16];
+    count(M_HASHED_BYTES, r);
+    memcpy(key, siphash2_4_128_r(buf, r, key, out), 16);
+}
+
+// writes the hash of fd to out, which is returned
+static uint8_t *
+hashfile_r(int fd, uint8_t *out)
+{
+    off_t off = 0;
+    char buf[4096];
+    ssize_t r;
+
+    count(M_HASHED, 1);
+    memcpy(out, siphash_zero, 16);
+    if ((r = pread(fd, buf, sizeof buf, off)) <= 0)
+	return out;
+    memcpy(out, redo_siphash_key, 16);
+    do {
+	hashblock(out, buf, r);
+	off += r;
+    } while ((r = pread(fd, buf, sizeof buf, off)) > 0);
+    return out;
+}
+
+static uint8_t *
+hashfile(int fd)
+{
+    static _Thread_local uint8_t out[16];
+    return hashfile_r(fd, out);
+}
+
+static char *
+datefile(int fd)
+{
+    static _Thread_local char hexdate[17];
+    struct stat st;
+
+    fstat(fd, &st);
+    snprintf(hexdate, sizeof hexdate, "%016" PRIx64, (uint64_t)st.st_ctime);
+
+    return hexdate;
+}
+
+// find/register dofiles
+
+static void
+redo_ifcreate(int fd, char *target)
+{
+    dprintf(fd, "-%s\n", target);
+}
+
+static _Thread_local mode_t dofile_mode;   // of the .do file found last
+
+static char *
+check_dofile(int at, const char *fmt, ...)
+{
+    static _Thread_local char dofile[PATH_MAX];
+    struct stat st;
+
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(dofile, sizeof dofile, fmt, ap);
+    va_end(ap);
+
+    count(M_DOFILE_PROBES, 1);
+    if (fstatat(at, dofile, &st, 0) == 0) {
+	dofile_mode = st.st_mode;
+	return dofile;
+    } else {
+	redo_ifcreate(dep_fd, dofile);
+	return 0;
+    }
+}
+
+/*
+  dir/base.a.b
+  will look for dir/base.a.b.do,
+  dir/default.a.b.do, dir/default.b.do, dir/default.do,
+  default.a.b.do, default.b.do, and default.do.
+
+  this function assumes no / in target, dir is the directory handle
+  of target or AT_FDCWD
+*/
+static char *
+find_dofile(int dir, char *target)
+{
+    char updir[PATH_MAX];
+    char *u = updir;
+    char *dofile, *s;
+    struct stat st, ost;
+
+    dofile = check_dofile(dir, "./%s.do", target);
+    if (dofile)
+	return dofile;
+
+    *u++ = '.';
+    *u++ = '/';
+    *u = 0;
+
+    st.st_dev = ost.st_dev = st.st_ino = ost.st_ino = 0;
+
+    while (1) {
+	ost = st;
+
+	if (fstatat(dir, updir, &st, 0) < 0)
+	    return 0;
+	if (ost.st_dev == st.st_dev && ost.st_ino == st.st_ino)
+	    break;  // reached root dir, .. = .
+
+	// also check ../target.do
+	dofile = check_dofile(dir, "%s%s.do", updir, target);
+	if (dofile)
+	    return dofile;
+	s = target;
+	while (*s) {
+	    if (*s++ == '.') {
+		dofile = check_dofile(dir, "%sdefault.%s.do", updir, s);
+		if (dofile)
+		    return dofile;
+	    }
+	}
+
+	dofile = check_dofile(dir, "%sdefault.do", updir);
+	if (dofile)
+	    return dofile;
+
+	*u++ = '.';
+	*u++ = '.';
+	*u++ = '/';
+	*u = 0;
+    }
+
+    return 0;
+}
+
+static _Thread_local char cwd_cache[PATH_MAX];   // see redo_base()
+
+// fchdir(), or chdir() if path is given, forgetting the working
+// directory cached by redo_base()
+static int
+changedir(int fd, const char *path)
+{
+    *cwd_cache = 0;
+    return path ? chdir(path) : fchdir(fd);
+}
+
+static char *
+targetchdir(char *target)
+{
+    char *base = strrchr(target, '/');
+    if (base) {
+	int fd;
+	*base = 0;
+	fd = openat(dir_fd, target, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+	    perror("openat dir");
+	    exit(111);
+	}
+	*base = '/';
+	if (changedir(fd, 0) < 0) {
+	    perror("chdir");
+	    exit(111);
+	}
+	close(fd);
+	return base+1;
+    } else {
+	changedir(dir_fd, 0);
+	return target;
+    }
+}
+
+// dependency handling, derived filenames
+
+char *db_dir;      // REDO_DB_DIR, absolute, or 0
+dev_t db_dev;
+static char db_cwd[PATH_MAX];   // of dir_fd, with REDO_DB_DIR
+
+void
+check_or_create_dir(const char *path)
+{
+    struct stat stats;
+    if (!mkdir(path, 0755)) return;
+    if (errno == ENOENT && db_dir) {
+	// create missing parents below REDO_DB_DIR
+	char parent[PATH_MAX], *slash;
+	snprintf(parent, sizeof parent, "%s", path);
+	if ((slash = strrchr(parent, '/')) && slash != parent) {
+	    *slash = 0;
+	    check_or_create_dir(parent);
+	    if (!mkdir(path, 0755)) return;
+	}
+    }
+    if (errno!=EEXIST) die2("failed to mkdir: ", path, 111);
+    if (stat(path, &stats) && errno != ENOENT) die2("failed to stat: ", path, 111);
+    if (!S_ISDIR(stats.st_mode)) die2("not a directory: ", path, 111);
+    if (access(path, R_OK|W_OK|X_OK)<0) die2("insufficient rights: ", path, 111);
+}
+
+// pick up REDO_DB_DIR, make it absolute for sub processes
+static void
+setup_db_dir()
+{
+    static char buf[PATH_MAX];
+    struct stat st;
+    char *s = getenv("REDO_DB_DIR");
+
+    if (!s || !*s)
+	return;
+    check_or_create_dir(s);
+    if (!realpath(s, buf) || stat(buf, &st) < 0)
+	die2("cannot use REDO_DB_DIR", s, 111);
+    if (setenv("REDO_DB_DIR", buf, 1)) die2("setenv", "REDO_DB_DIR", 100);
+    db_dir = strcmp(buf, "/") ? buf : (char *)"";
+    db_dev = st.st_dev;
+    if (!getcwd(db_cwd, sizeof db_cwd))
+	die("getcwd", 111);
+}
+
+enum { IO_SYNC, IO_THREADS, IO_URING };
+static int io_mode = IO_SYNC;
+
+// pick up REDO_IO: sync (default), threads or uring
+static void
+setup_io()
+{
+    char *s = getenv("REDO_IO");
+
+    if (!s || !*s || !strcmp(s, "sync"))
+	io_mode = IO_SYNC;
+    else if (!strcmp(s, "threads"))
+	io_mode = IO_THREADS;
+    else if (!strcmp(s, "uring"))
+	io_mode = IO_URING;
+    else
+	die2("invalid REDO_IO, use sync, threads or uring", s, 111);
+}
+
+// The database directory holding the dep file, lock and temp files of
+// target, relative to the current directory.  This is .redo in the
+// directory of target, or, when REDO_DB_DIR is set, the directory of
+// target mapped below REDO_DB_DIR by its absolute path.  The working
+// directory is looked up once after each changedir().
+static const char *
+redo_base(const char *target)
+{
+    static _Thread_local char buf[2*PATH_MAX];
+    char *cwd = cwd_cache;
+    const char *slash = strrchr(target, '/');
+    int dirlen = slash ? slash - target : 0;
+
+    if (!db_dir) {
+	if (!slash)
+	    return ".redo";
+	snprintf(buf, sizeof buf, "%.*s/.redo", dirlen, target);
+    } else if (*target == '/') {
+	snprintf(buf, sizeof buf, "%s%.*s", db_dir, dirlen, target);
+    } else {
+	if (!*cwd && getcwd(cwd, sizeof cwd_cache) == NULL) die("getcwd", 100);
+	snprintf(buf, sizeof buf, "%s%s%s%.*s", db_dir, strcmp(cwd, "/") ? cwd : "",
+		 slash ? "/" : "", dirlen, target);
+    }
+    return buf;
+}
+
+// like redo_base(), for the directory path, relative to it.  path is
+// absolute or relative to dir_fd, whose absolute path was taken at
+// startup, so the working directory stays as it is.
+static const char *
+redo_base_dir(const char *path)
+{
+    static _Thread_local char buf[2*PATH_MAX];
+    char abs[2*PATH_MAX], real[PATH_MAX];
+
+    if (!db_dir)
+	return ".redo";
+    snprintf(abs, sizeof abs, "%s%s%s", *path == '/' ? "" : db_cwd,
+	     *path == '/' ? "" : "/", path);
+    if (!realpath(abs, real))
+	die2("cannot locate directory in REDO_DB_DIR", abs, 111);
+    snprintf(buf, sizeof buf, "%s%s", db_dir, strcmp(real, "/") ? real : "");
+    return buf;
+}
+
+// targets are in the current directory
+static char *
+targetdep(char *target)
+{
+    static _Thread_local char buf[2*PATH_MAX+8];
+    snprintf(buf, sizeof buf, "%s/%s.dep", redo_base(target), target);
+    return buf;
+}
+
+static char *
+targetusage(char *target)
+{
+    static _Thread_local char buf[2*PATH_MAX+8];
+    snprintf(buf, sizeof buf, "%s/%s.rusage", redo_base(target), target);
+    return buf;
+}
+
+static char *
+targetlock(char *target)
+{
+    static _Thread_local char buf[2*PATH_MAX+8];
+    snprintf(buf, sizeof buf, "%s/%s.lock", redo_base(target), target);
+    return buf;
+}
+
+static char *
+targettmp(const char *prefix, unsigned int id, const char *target)
+{
+    static _Thread_local char buf[2*PATH_MAX+32];
+    snprintf(buf, sizeof buf, "%s/%s.%u.%s", redo_base(target), prefix, id, target);
+    return buf;
+}
+
+// temporary output file for target, it must be on the same file system
+// as target to be renamed into place.  This is the database
+// directory, unless REDO_DB_DIR is on another file system, then the
+// current directory.
+static char *
+targetout(unsigned int id, const char *target)
+{
+    static _Thread_local char buf[PATH_MAX+32];
+    struct stat st;
+
+    if (db_dir && (stat(".", &st) < 0 || st.st_dev != db_dev)) {
+	snprintf(buf, sizeof buf, ".redo.tmp.%u.%s", id, target);
+	return buf;
+    }
+    return targettmp(".tmp", id, target);
+}
+
+// directory tree dependencies
+
+/*
+  A tree dependency stands for a Merkle hash over all entries below a
+  directory: each directory hashes the sorted list of its entries'
+  types, names and hashes.  Only regular files (and symlinks) whose
+  basename matches the glob are included, subdirectories always are,
+  .redo directories never.
+
+  Results are cached in dir/.redo/tree.<hash of glob>, one line per
+  entry: "type stamp hash path".  A directory whose mtime did not
+  change is not read again, its children are taken from the cache.  A
+  file whose ctime did not change is not hashed again.  Each entry
+  still costs one fstatat().  redo-ood leaves the cache as it is.
+*/
+
+struct tree_entry {
+    char type;                 // d, f or l
+    char stamp[40];
+    char hash[HASH_CHARS+1];
+    char *path;                // relative to tree root, "" is the root
+};
+
+struct tree {
+    int root_fd;
+    const char *glob;
+    struct timespec cached;    // mtime of the cache file
+    struct tree_entry *old, *new;
+    size_t nold, nnew, anew;
+};
+
+static int db_readonly;   // redo_ood(): no cache refresh, no check_settle()
+
+static int
+tree_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct tree_entry *)a)->path,
+		  ((const struct tree_entry *)b)->path);
+}
+
+// stamps not older than the cache itself cannot be trusted,
+// the entry might have changed again within the same clock tick
+static int
+tree_stamp(struct tree *t, char *buf, size_t size, struct timespec *ts)
+{
+    snprintf(buf, size, "%" PRIx64 ".%lx", (uint64_t)ts->tv_sec, ts->tv_nsec);
+    return ts->tv_sec < t->cached.tv_sec ||
+	(ts->tv_sec == t->cached.tv_sec && ts->tv_nsec < t->cached.tv_nsec);
+}
+
+static void
+tree_add(struct tree *t, char type, const char *stamp, const char *hash, const char *path)
+{
+    struct tree_entry *e;
+
+    if (t->nnew == t->anew) {
+	t->anew = t->anew ? 2*t->anew : 64;
+	t->new = realloc(t->new, t->anew * sizeof *t->new);
+	if (!t->new)
+	    die("out of memory", 100);
+    }
+    e = &t->new[t->nnew++];
+    e->type = type;
+    snprintf(e->stamp, sizeof e->stamp, "%s", stamp);
+    snprintf(e->hash, sizeof e->hash, "%s", hash);
+    if (!(e->path = strdup(path)))
+	die("out of memory", 100);
+}
+
+static void
+tree_load(struct tree *t, const char *cachefile)
+{
+    char line[PATH_MAX+128];
+    struct stat st;
+    int fd = openat(t->root_fd, cachefile, O_RDONLY | O_CLOEXEC);
+    FILE *f = fd < 0 ? 0 : fdopen(fd, "r");
+
+    if (!f) {
+	if (fd >= 0)
+	    close(fd);
+	return;
+    }
+    if (fstat(fileno(f), &st) < 0) {
+	fclose(f);
+	return;
+    }
+    t->cached = st.st_mtim;
+    while (fgets(line, sizeof line, f)) {
+	char stamp[40], hash[HASH_CHARS+1];
+	int n = 0;
+
+	line[strcspn(line, "\n")] = 0;
+	if (sscanf(line, "%*c %39s %32s %n", stamp, hash, &n) != 2 || !n)
+	    continue;
+	// reuse tree_add to fill the new array, then swap
+	tree_add(t, line[0], stamp, hash, line + n);
+    }
+    fclose(f);
+    t->old = t->new;
+    t->nold = t->nnew;
+    t->new = 0;
+    t->nnew = t->anew = 0;
+    qsort(t->old, t->nold, sizeof *t->old, tree_cmp);
+}
+
+static struct tree_entry *
+tree_find(struct tree *t, const char *path)
+{
+    struct tree_entry key;
+    key.path = (char *)path;
+    return bsearch(&key, t->old, t->nold, sizeof *t->old, tree_cmp);
+}
+
+static int
+name_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// collect the names of the entries of directory path, sorted
+static char **
+tree_list(struct tree *t, const char *path, int cached, size_t *count)
+{
+    char **names = 0;
+    size_t n = 0, a = 0;
+
+    if (cached) {
+	// children are the cached entries path/name without further /
+	size_t plen = strlen(path), lo = 0, hi = t->nold;
+	while (lo < hi) {   // lower bound of prefix "path/"
+	    size_t mid = (lo + hi) / 2;
+	    int c = strncmp(t->old[mid].path, path, plen);
+	    if (c < 0 || (c == 0 && plen && t->old[mid].path[plen] < '/'))
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	for (; lo < t->nold; lo++) {
+	    const char *p = t->old[lo].path;
+	    if (plen && (strncmp(p, path, plen) != 0 || p[plen] != '/'))
+		break;
+	    p += plen ? plen + 1 : 0;
+	    if (!*p || strchr(p, '/'))
+		continue;
+	    if (n == a && !(names = realloc(names, (a = a ? 2*a : 16) * sizeof *names)))
+		die("out of memory", 100);
+	    if (!(names[n++] = strdup(p)))
+		die("out of memory", 100);
+	}
+    } else {
+	struct dirent *de;
+	int fd = openat(t->root_fd, *path ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR *d = fd < 0 ? 0 : fdopendir(fd);
+
+	if (!d) {
+	    if (fd >= 0)
+		close(fd);
+	    *count = 0;
+	    return 0;
+	}
+	while ((de = readdir(d))) {
+	    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+		!strcmp(de->d_name, ".redo"))
+		continue;
+	    if (n == a && !(names = realloc(names, (a = a ? 2*a : 16) * sizeof *names)))
+		die("out of memory", 100);
+	    if (!(names[n++] = strdup(de->d_name)))
+		die("out of memory", 100);
+	}
+	closedir(d);
+    }
+    qsort(names, n, sizeof *names, name_cmp);
+    *count = n;
+    return names;
+}
+
+// hash the directory path below the tree root into hash, 0 on error
+static int
+tree_walk(struct tree *t, const char *path, char *hash)
+{
+    struct stat st;
+    struct tree_entry *e;
+    char stamp[40], child[PATH_MAX], childhash[HASH_CHARS+1];
+    char **names;
+    char *buf = 0;
+    size_t i, n, len = 0, size = 0;
+    int ok = 1, trusted;
+
+    if (fstatat(t->root_fd, *path ? path : ".", &st, 0) < 0 || !S_ISDIR(st.st_mode))
+	return 0;
+    trusted = tree_stamp(t, stamp, sizeof stamp, &st.st_mtim);
+    e = tree_find(t, path);
+
+    names = tree_list(t, path,
+		      trusted && e && e->type == 'd' && !strcmp(e->stamp, stamp), &n);
+
+    for (i = 0; i < n; i++) {
+	char type = 0, cstamp[40];
+	struct tree_entry *ce;
+
+	snprintf(child, sizeof child, "%s%s%s", path, *path ? "/" : "", names[i]);
+	if (fstatat(t->root_fd, child, &st, AT_SYMLINK_NOFOLLOW) < 0)
+	    goto next;   // vanished after reading the directory
+
+	if (S_ISDIR(st.st_mode)) {
+	    type = 'd';
+	    if (!tree_walk(t, child, childhash))
+		ok = 0;
+	} else if (fnmatch(t->glob, names[i], 0) != 0) {
+	    goto next;
+	} else if (S_ISLNK(st.st_mode)) {
+	    char link[PATH_MAX];
+	    ssize_t r = readlinkat(t->root_fd, child, link, sizeof link);
+	    type = 'l';
+	    if (r < 0)
+		r = 0;
+	    snprintf(childhash, sizeof childhash, "%s",
+		     hashtohex(siphash2_4_128(link, r, redo_siphash_key)));
+	    tree_add(t, type, "0", childhash, child);
+	} else if (S_ISREG(st.st_mode)) {
+	    type = 'f';
+	    trusted = tree_stamp(t, cstamp, sizeof cstamp, &st.st_ctim);
+	    ce = tree_find(t, child);
+	    if (trusted && ce && ce->type == 'f' && !strcmp(ce->stamp, cstamp)) {
+		snprintf(childhash, sizeof childhash, "%s", ce->hash);
+	    } else {
+		int fd = openat(t->root_fd, child, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+		    ok = 0;
+		    goto next;
 		}
+		snprintf(childhash, sizeof childhash, "%s", hashtohex(hashfile(fd)));
+		close(fd);
+	    }
+	    tree_add(t, type, cstamp, childhash, child);
+	} else {
+	    goto next;
+	}
+
+	// append "type hash name\n" to the listing
+	size_t need = strlen(names[i]) + HASH_CHARS + 4;
+	if (len + need > size) {
+	    size = 2 * (len + need);
+	    if (!(buf = realloc(buf, size)))
+		die("out of memory", 100);
+	}
+	len += snprintf(buf + len, size - len, "%c %s %s\n", type, childhash, names[i]);
+    next:
+	free(names[i]);
+    }
+    free(names);
+
+    snprintf(hash, HASH_CHARS+1, "%s",
+	     hashtohex(siphash2_4_128(buf ? buf : "", len, redo_siphash_key)));
+    free(buf);
+    // a listing which left out an unreadable file is not reused
+    if (ok)
+	tree_add(t, 'd', stamp, hash, path);
+    return ok;
+}
+
+static int checkdir_fd(int dir);
+static int checkdir_open(int parent, const char *rel);
+static const char *checkdir_base(int dir);
+
+// dirglob is "dir/glob", relative to the checked directory at.
+// Returns hex Merkle hash, or 0 if dir is not a readable directory.
+static char *
+tree_hash(int at, const char *dirglob)
+{
+    static _Thread_local char hash[HASH_CHARS+1];
+    char dir[PATH_MAX], cachedir[2*PATH_MAX], cachefile[2*PATH_MAX+48], tmpfile[2*PATH_MAX+64];
+    struct tree t = { -1, 0, { 0, 0 }, 0, 0, 0, 0, 0 };
+    char *slash, *result = 0;
+    size_t i;
+    FILE *f;
+    int fd;
+
+    snprintf(dir, sizeof dir, "%s", dirglob);
+    if (!(slash = strrchr(dir, '/')))
+	return 0;
+    *slash = 0;
+    t.glob = dirglob + (slash - dir) + 1;
+    if (!*dir)
+	strcpy(dir, "/");
+
+    if ((fd = checkdir_fd(at)) < 0 ||
+	(t.root_fd = openat(fd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+	return 0;
+
+    // cache paths are relative to the tree root
+    if (db_dir && (fd = checkdir_open(at, dir)) < 0) {
+	close(t.root_fd);
+	return 0;
+    }
+    snprintf(cachedir, sizeof cachedir, "%s", db_dir ? checkdir_base(fd) : ".redo");
+    snprintf(cachefile, sizeof cachefile, "%s/tree.%s", cachedir,
+	     hashtohex(siphash2_4_128(t.glob, strlen(t.glob), redo_siphash_key)));
+    tree_load(&t, cachefile);
+
+    if (tree_walk(&t, "", hash))
+	result = hash;
+
+    // refresh the cache, failure to do so is not fatal
+    snprintf(tmpfile, sizeof tmpfile, "%s.%d", cachefile, (int)getpid());
+    if (db_dir && !db_readonly)
+	check_or_create_dir(cachedir);
+    if (!db_readonly && (db_dir || mkdirat(t.root_fd, cachedir, 0755) == 0 || errno == EEXIST) &&
+	(fd = openat(t.root_fd, tmpfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) >= 0) {
+	if (!(f = fdopen(fd, "w"))) {
+	    close(fd);
+	} else {
+	    for (i = 0; i < t.nnew; i++)
+		fprintf(f, "%c %s %s %s\n", t.new[i].type, t.new[i].stamp,
+			t.new[i].hash, t.new[i].path);
+	    if (fclose(f) == 0)
+		renameat(t.root_fd, tmpfile, t.root_fd, cachefile);
+	    else
+		unlinkat(t.root_fd, tmpfile, 0);
+	}
+    }
+
+    for (i = 0; i < t.nold; i++)
+	free(t.old[i].path);
+    for (i = 0; i < t.nnew; i++)
+	free(t.new[i].path);
+    free(t.old);
+    free(t.new);
+    close(t.root_fd);
+    return result;
+}
+
+// immutable roots
+
+/*
+  REDO_IMMUTABLE="/opt/toolchain=VERSION /usr/include" declares trees
+  which only change as a whole, like a pinned toolchain replaced by a
+  version bump.  redo-ifchange of a file below a root with a stamp
+  file (relative to the root, or absolute) also records the stamp.
+  Checks skip the '=' lines below a root if the dep file records its
+  stamp, which is checked like any dependency, once per process; lines
+  below a root without stamp are always skipped.  Paths are compared
+  lexically, after making them absolute.
+*/
+
+#define IMMUTABLES 32
+
+static struct immutable {
+    char *root;       // absolute, without trailing /
+    size_t len;
+    char *stamp;      // absolute, 0 if none
+    int recorded;     // by our redo-ifchange
+} immutables[IMMUTABLES];
+static int nimmutables;
+static char immutable_cwd[PATH_MAX];   // of dir_fd
+
+static void db_path(const char *dir, const char *name, char *out, size_t size);
+
+// pick up REDO_IMMUTABLE, made absolute for sub processes
+static void
+setup_immutable()
+{
+    char *s = getenv("REDO_IMMUTABLE"), *env, *stamp, *cwd = immutable_cwd;
+    char root[PATH_MAX], buf[2*PATH_MAX], spec[2*PATH_MAX];
+    size_t envlen = 0;
+    int n, i;
+
+    if (!s || !*s)
+	return;
+    if (!getcwd(cwd, sizeof immutable_cwd))
+	die("getcwd", 111);
+    if (!(env = malloc(IMMUTABLES * (4*PATH_MAX + 2))))
+	die("out of memory", 100);
+    *env = 0;
+    while (sscanf(s, " %4095s%n", spec, &n) == 1 && nimmutables < IMMUTABLES - 1) {
+	s += n;
+	if ((stamp = strchr(spec, '=')))
+	    *stamp++ = 0;
+	db_path(cwd, spec, buf, sizeof buf);
+	// a symlinked root is also known by its real path
+	if (!realpath(buf, root) || !strcmp(buf, root))
+	    *root = 0;
+	for (i = 0; i < 2; i++) {
+	    struct immutable *im = &immutables[nimmutables];
+	    const char *r = i ? root : buf;
+	    if (!*r)
+		continue;
+	    if (!(im->root = strdup(r)))
+		die("out of memory", 100);
+	    im->len = strcmp(r, "/") ? strlen(r) : 0;   // "/": all paths
+	    im->stamp = 0;
+	    if (stamp && *stamp) {
+		char path[2*PATH_MAX];
+		db_path(buf, stamp, path, sizeof path);
+		if (!(im->stamp = strdup(path)))
+		    die("out of memory", 100);
+	    }
+	    nimmutables++;
+	}
+	envlen += sprintf(env + envlen, "%s%s%s%s", envlen ? " " : "", buf,
+			  stamp && *stamp ? "=" : "", immutables[nimmutables-1].stamp ?
+			  immutables[nimmutables-1].stamp : "");
+    }
+    if (setenv("REDO_IMMUTABLE", env, 1)) die2("setenv", "REDO_IMMUTABLE", 100);
+    free(env);
+}
+
+// the immutable root path is below, -1 if none.  path is relative to
+// the working directory of the process (dir_fd), or absolute.
+static int
+immutable_root(const char *path)
+{
+    char abs[2*PATH_MAX];
+    int i;
+
+    db_path(immutable_cwd, path, abs, sizeof abs);
+    for (i = 0; i < nimmutables; i++) {
+	struct immutable *im = &immutables[i];
+	if (!strncmp(abs, im->root, im->len) && abs[im->len] == '/')
+	    return im->stamp && !strcmp(abs, im->stamp) ? -1 : i;
+    }
+    return -1;
+}
+
+// the roots whose '=' lines deps can skip, a bit per root
+static unsigned
+immutable_covered(const char *deps)
+{
+    char rec[PATH_MAX+2];
+    unsigned covered = 0;
+    int i;
+
+    for (i = 0; i < nimmutables; i++) {
+	snprintf(rec, sizeof rec, " %s\n", immutables[i].stamp ? immutables[i].stamp : "");
+	if (!immutables[i].stamp || strstr(deps, rec))
+	    covered |= 1u << i;
+    }
+    return covered;
+}
+
+// git index
+
+/*
+  With REDO_GIT=1, a file git tracks is hashed only once per content:
+  if it did not change since it was added to the index of its work
+  tree (its time stamps, inode and size match the index entry, which
+  is not racily clean), its hash is kept under its object ID in the
+  git directory of the database, and later found there without reading
+  the file.  The hash is the same as without REDO_GIT, so switching
+  does not rebuild anything.  The index is read once per process, when
+  first needed, without running git; split indexes are not used.
+*/
+
+struct git_entry {
+    char *path;                 // relative to the work tree
+    const unsigned char *e;     // the entry in the mapped index
+};
+static int git_mode;                 // REDO_GIT
+static char git_cwd[PATH_MAX];       // of dir_fd
+static char git_root[PATH_MAX];      // the work tree
+static struct git_entry *git_entries;
+static int ngit_entries;
+static size_t git_oid = 20;          // length of object IDs
+static struct timespec git_stamp;    // of the index
+static char git_cache[2*PATH_MAX+8]; // the hashes by object ID
+static pthread_once_t git_once = PTHREAD_ONCE_INIT;
+
+// pick up REDO_GIT
+static void
+setup_git()
+{
+    git_mode = envfd("REDO_GIT") > 0;
+    if (git_mode && !getcwd(git_cwd, sizeof git_cwd))
+	die("getcwd", 111);
+}
+
+static uint32_t
+be32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static int
+git_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct git_entry *)a)->path, ((const struct git_entry *)b)->path);
+}
+
+// whether the repository config in gitdir uses SHA-256 object IDs
+static int
+git_sha256(const char *gitdir)
+{
+    char path[2*PATH_MAX+48], buf[4096], *s;
+    ssize_t r;
+    int fd;
+
+    snprintf(path, sizeof path, "%s/config", gitdir);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+	return 0;
+    r = read(fd, buf, sizeof buf - 1);
+    close(fd);
+    buf[r > 0 ? r : 0] = 0;
+    for (s = buf; *s; s++)
+	*s = *s >= 'A' && *s <= 'Z' ? *s + 'a' - 'A' : *s;
+    return strstr(buf, "objectformat = sha256") != 0;
+}
+
+// find the work tree of git_cwd and read its index
+static void
+git_load()
+{
+    char dir[PATH_MAX], dotgit[PATH_MAX+8], gitdir[2*PATH_MAX], path[2*PATH_MAX+16];
+    char buf[PATH_MAX+16], *s;
+    const unsigned char *map, *p, *end;
+    char *prev = (char *)"";
+    struct stat st;
+    uint32_t version, n, i;
+    ssize_t r;
+    int fd;
+
+    snprintf(dir, sizeof dir, "%s", git_cwd);
+    for (;;) {
+	snprintf(dotgit, sizeof dotgit, "%s/.git", strcmp(dir, "/") ? dir : "");
+	if (stat(dotgit, &st) == 0)
+	    break;
+	if (!strcmp(dir, "/"))
+	    return;   // not in a work tree
+	s = strrchr(dir, '/');
+	s[s == dir] = 0;   // up, keeping the / of the root
+    }
+    if (S_ISDIR(st.st_mode)) {
+	snprintf(gitdir, sizeof gitdir, "%s", dotgit);
+    } else {
+	// "gitdir: path" of a linked work tree or a submodule
+	if ((fd = open(dotgit, O_RDONLY | O_CLOEXEC)) < 0)
+	    return;
+	r = read(fd, buf, sizeof buf - 1);
+	close(fd);
+	buf[r > 0 ? r : 0] = 0;
+	if (strncmp(buf, "gitdir: ", 8))
+	    return;
+	buf[strcspn(buf, "\r\n")] = 0;
+	db_path(dir, buf + 8, gitdir, sizeof gitdir);
+    }
+    // a linked work tree shares the config of the main one
+    snprintf(path, sizeof path, "%s/commondir", gitdir);
+    if (git_sha256(gitdir)) {
+	git_oid = 32;
+    } else if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+	r = read(fd, buf, sizeof buf - 1);
+	close(fd);
+	buf[r > 0 ? r : 0] = 0;
+	buf[strcspn(buf, "\r\n")] = 0;
+	db_path(gitdir, buf, path, sizeof path);
+	if (git_sha256(path))
+	    git_oid = 32;
+    }
+
+    snprintf(path, sizeof path, "%s/index", gitdir);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+	return;
+    if (fstat(fd, &st) < 0 || st.st_size < 12 + (off_t)git_oid ||
+	(map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+	close(fd);
+	return;
+    }
+    close(fd);
+    git_stamp = st.st_mtim;
+    end = map + st.st_size - git_oid;   // the checksum follows
+    version = be32(map + 4);
+    n = be32(map + 8);
+    if (memcmp(map, "DIRC", 4) || version < 2 || version > 4 ||
+	!(git_entries = malloc((n ? n : 1) * sizeof *git_entries)))
+	goto bad;
+
+    for (p = map + 12, i = 0; i < n; i++) {
+	const unsigned char *e = p, *name;
+	size_t fixed = 40 + git_oid + 2, len, strip = 0;
+	if (p + fixed + 2 > end)
+	    goto bad;
+	if (version >= 3 && (e[fixed-2] & 0x40))
+	    fixed += 2;   // extended flags
+	name = e + fixed;
+	if (version < 4) {
+	    len = strnlen((const char *)name, end - name);
+	    if (name + len >= end)
+		goto bad;
+	    git_entries[i].path = (char *)name;
+	    p = e + ((fixed + len + 8) & ~(size_t)7);   // padded with 1-8 NULs
+	} else {
+	    // a varint of bytes to strip from the previous path, the rest
+	    unsigned char c = *name++;
+	    strip = c & 127;
+	    while (c & 128 && name < end) {
+		c = *name++;
+		strip = ((strip + 1) << 7) + (c & 127);
+	    }
+	    len = strnlen((const char *)name, end - name);
+	    if (name + len >= end || strip > strlen(prev) ||
+		!(s = malloc(strlen(prev) - strip + len + 1)))
+		goto bad;
+	    memcpy(s, prev, strlen(prev) - strip);
+	    memcpy(s + strlen(prev) - strip, name, len + 1);
+	    git_entries[i].path = prev = s;
+	    p = name + len + 1;
+	}
+	git_entries[i].e = e;
+	ngit_entries = i + 1;
+    }
+    // extensions: a split index does not list all entries
+    while (p + 8 <= end) {
+	if (!memcmp(p, "link", 4))
+	    goto bad;
+	p += 8 + be32(p + 4);
+    }
+    snprintf(git_root, sizeof git_root, "%s", strcmp(dir, "/") ? dir : "");
+    if (db_dir)   // beside the mirrored tree, not in it
+	snprintf(git_cache, sizeof git_cache, "%s/.redo-git", db_dir);
+    else
+	snprintf(git_cache, sizeof git_cache, "%s/.redo/git", git_cwd);
+    return;
+bad:
+    ngit_entries = 0;
+}
+
+// the object ID in the git index of file path (relative to directory
+// dir, or the working directory if dir is 0) with status st, as hex
+// into oid.  0 if git does not track it, or it changed since it was
+// added.
+static int
+git_lookup(const char *dir, const char *path, struct stat *st, char *oid)
+{
+    char cwd[PATH_MAX], abs[2*PATH_MAX];
+    struct git_entry key, *g;
+    const unsigned char *e;
+    size_t len, i;
+
+    pthread_once(&git_once, git_load);
+    if (!ngit_entries || !S_ISREG(st->st_mode))
+	return 0;
+    len = strlen(git_root);
+    if (!dir && !(dir = getcwd(cwd, sizeof cwd)))
+	return 0;
+    db_path(dir, path, abs, sizeof abs);
+    if (strncmp(abs, git_root, len) || abs[len] != '/')
+	return 0;
+    key.path = abs + len + 1;
+    if (!(g = bsearch(&key, git_entries, ngit_entries, sizeof *g, git_cmp)))
+	return 0;
+    e = g->e;
+    // assume-valid, a merge stage, skip-worktree or intent-to-add
+    if (e[40 + git_oid] & 0xb0 ||
+	(e[40 + git_oid] & 0x40 && e[42 + git_oid] & 0x60))
+	return 0;
+    if (be32(e) != (uint32_t)st->st_ctim.tv_sec ||
+	(be32(e + 4) && be32(e + 4) != (uint32_t)st->st_ctim.tv_nsec) ||
+	be32(e + 8) != (uint32_t)st->st_mtim.tv_sec ||
+	(be32(e + 12) && be32(e + 12) != (uint32_t)st->st_mtim.tv_nsec) ||
+	be32(e + 20) != (uint32_t)st->st_ino ||
+	be32(e + 36) != (uint32_t)st->st_size)
+	return 0;
+    // racily clean: changed in the same tick the index was written
+    if (st->st_mtim.tv_sec > git_stamp.tv_sec ||
+	(st->st_mtim.tv_sec == git_stamp.tv_sec && st->st_mtim.tv_nsec >= git_stamp.tv_nsec))
+	return 0;
+    for (i = 0; i < git_oid; i++)
+	snprintf(oid + 2*i, 3, "%02x", e[40 + i]);
+    return 1;
+}
+
+// writes the hash of fd to out, which is returned.  With REDO_GIT,
+// path names the file relative to dir (the working directory if 0),
+// and the hash of a tracked file is looked up by its object ID.
+static uint8_t *
+hashfile_git(int fd, const char *dir, const char *path, uint8_t *out)
+{
+    static unsigned seq;
+    char oid[2*32+1], cache[sizeof git_cache + 2*32+2], tmp[sizeof cache + 32];
+    char hex[HASH_CHARS];
+    struct stat st, st2;
+    int i, cfd;
+
+    if (!git_mode || !path || fstat(fd, &st) < 0 || !git_lookup(dir, path, &st, oid))
+	return hashfile_r(fd, out);
+    snprintf(cache, sizeof cache, "%s/%s", git_cache, oid);
+    if ((cfd = open(cache, O_RDONLY | O_CLOEXEC)) >= 0) {
+	i = read(cfd, hex, sizeof hex) == sizeof hex ? 0 : HASH_CHARS/2;
+	close(cfd);
+	for (; i < HASH_CHARS/2; i++)
+	    if (sscanf(hex + 2*i, "%2hhx", &out[i]) != 1)
+		break;
+	if (i == HASH_CHARS/2) {
+	    count(M_GIT_HASHES, 1);
+	    return out;
+	}
+    }
+    // the first time this content is seen, unless it changed meanwhile
+    hashfile_r(fd, out);
+    if (fstat(fd, &st2) < 0 || st2.st_size != st.st_size ||
+	st2.st_mtim.tv_sec != st.st_mtim.tv_sec || st2.st_mtim.tv_nsec != st.st_mtim.tv_nsec ||
+	st2.st_ctim.tv_sec != st.st_ctim.tv_sec || st2.st_ctim.tv_nsec != st.st_ctim.tv_nsec)
+	return out;
+    snprintf(tmp, sizeof tmp, "%s.%d.%u", cache, (int)getpid(), __sync_fetch_and_add(&seq, 1));
+    mkdir(git_cache, 0755);
+    if ((cfd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) >= 0) {
+	if (write(cfd, hashtohex(out), HASH_CHARS) != HASH_CHARS ||
+	    close(cfd) < 0 || rename(tmp, cache) < 0)
+	    unlink(tmp);
+    }
+    return out;
+}
+
+// dependency checking
+
+/*
+  check_deps() does not change the working directory.  Directories are
+  opened once and kept in checkdirs, together with their database
+  directory, and all lookups are relative to these handles.  Stat and
+  check results of files are remembered in memos for the life time of
+  the process, so a dependency shared by many targets is looked at
+  once.  A dependency is only opened when its hash has to be computed.
+*/
+
+#define CHECK_FDS 256   // directory handles kept open at most
+
+struct checkdir {
+    int fd;              // -1 when closed to save handles
+    int dbfd;            // database directory, -1 none, -2 not looked up
+    dev_t dev;
+    ino_t ino;
+    uint64_t bits;       // see checkdir_bits(), 0 until needed
+    char *base;          // see checkdir_base(), 0 until needed
+    char *path;          // relative to dir_fd
+};
+static struct checkdir *checkdirs;
+static int ncheckdirs, acheckdirs, checkfds, checkevict, checkpin;
+static time_t check_since;   // no hash in memos is older
+
+enum { CHECK_UNKNOWN, CHECK_BUSY, CHECK_OK, CHECK_REBUILD, CHECK_BUILT };
+
+struct memo {
+    struct memo *next;
+    int dir;
+    char type;           // 'd': value is the index into checkdirs
+                         // 'f': value is a CHECK_ state
+    int value;
+    int64_t ctime;       // -1 does not exist, -2 not stat'ed yet
+    signed char hashed;  // sum: 0 not computed, 1 valid, -1 unreadable
+    uint8_t sum[16];
+    ino_t dep_ino;       // of the dep file checked: 0 none, -1 not checked
+    uint64_t dirs;       // looked into by check_file(), see verified_put()
+    char name[];
+};
+#define MEMO_BUCKETS 4096
+static struct memo *memos[MEMO_BUCKETS];
+
+static struct memo *
+memo_get(int dir, char type, const char *name)
+{
+    uint32_t h = 2166136261u ^ (uint32_t)dir ^ ((uint32_t)type << 24);
+    const char *s;
+    struct memo *m;
+
+    for (s = name; *s; s++)
+	h = (h ^ (uint8_t)*s) * 16777619u;
+    for (m = memos[h % MEMO_BUCKETS]; m; m = m->next)
+	if (m->dir == dir && m->type == type && !strcmp(m->name, name)) {
+	    count(M_CACHE_HITS, 1);
+	    return m;
+	}
+    count(M_CACHE_MISSES, 1);
+
+    if (!(m = malloc(sizeof *m + strlen(name) + 1)))
+	die("out of memory", 100);
+    m->dir = dir;
+    m->type = type;
+    m->value = type == 'd' ? -1 : CHECK_UNKNOWN;
+    m->ctime = -2;
+    m->hashed = 0;
+    m->dep_ino = (ino_t)-1;
+    m->dirs = 0;
+    strcpy(m->name, name);
+    m->next = memos[h % MEMO_BUCKETS];
+    memos[h % MEMO_BUCKETS] = m;
+    return m;
+}
+
+// close handles of another directory when too many are open, unless
+// a batch of io_prefetch() still needs them
+static void
+checkdir_evict()
+{
+    while (checkfds >= CHECK_FDS && !checkpin) {
+	struct checkdir *d;
+	checkevict = checkevict % (ncheckdirs - 1) + 1;   // never the root
+	d = &checkdirs[checkevict];
+	if (d->fd >= 0) {
+	    close(d->fd);
+	    d->fd = -1;
+	    checkfds--;
+	}
+	if (d->dbfd >= 0) {
+	    close(d->dbfd);
+	    d->dbfd = -2;
+	    checkfds--;
+	}
+    }
+}
+
+static int
+checkdir_fd(int dir)
+{
+    struct checkdir *d = &checkdirs[dir];
+    if (d->fd < 0) {
+	checkdir_evict();
+	d->fd = openat(dir_fd, d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (d->fd < 0)
+	    return -1;
+	checkfds++;
+    }
+    return d->fd;
+}
+
+// the database directory, relative to the directory, see redo_base_dir()
+static const char *
+checkdir_base(int dir)
+{
+    struct checkdir *d = &checkdirs[dir];
+
+    if (!d->base && !(d->base = strdup(redo_base_dir(d->path))))
+	die("out of memory", 100);
+    return d->base;
+}
+
+// handle of the database directory, -1 if there is none
+static int
+checkdir_db(int dir)
+{
+    struct checkdir *d = &checkdirs[dir];
+    int fd;
+
+    if (d->dbfd == -2 && (fd = checkdir_fd(dir)) >= 0) {
+	checkdir_evict();
+	d->dbfd = openat(fd, checkdir_base(dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (d->dbfd >= 0)
+	    checkfds++;
+    }
+    return d->dbfd;
+}
+
+static void
+checkdir_root()
+{
+    struct stat st;
+
+    if (ncheckdirs)
+	return;
+    if (fstat(dir_fd, &st) < 0)
+	die("cannot stat working directory", 111);
+    if (!(checkdirs = malloc((acheckdirs = 64) * sizeof *checkdirs)))
+	die("out of memory", 100);
+    check_since = time(0);
+    checkdirs[0].fd = dir_fd;
+    checkdirs[0].dbfd = -2;
+    checkdirs[0].dev = st.st_dev;
+    checkdirs[0].ino = st.st_ino;
+    checkdirs[0].bits = 0;
+    checkdirs[0].base = 0;
+    checkdirs[0].path = (char *)".";
+    ncheckdirs = 1;
+}
+
+// index of directory rel relative to directory parent, -1 on error
+static int
+checkdir_open(int parent, const char *rel)
+{
+    struct memo *m = memo_get(parent, 'd', rel);
+    struct checkdir *d;
+    struct stat st;
+    char path[PATH_MAX];
+    int i, fd, pfd;
+
+    if (m->value >= 0)
+	return m->value;
+
+    pfd = *rel == '/' ? AT_FDCWD : checkdir_fd(parent);
+    if (pfd == -1)
+	return -1;
+    checkdir_evict();
+    fd = openat(pfd, rel, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+	return -1;
+    if (fstat(fd, &st) < 0) {
+	close(fd);
+	return -1;
+    }
+    // different spellings of the same directory share one entry
+    for (i = 0; i < ncheckdirs; i++) {
+	if (checkdirs[i].dev == st.st_dev && checkdirs[i].ino == st.st_ino) {
+	    close(fd);
+	    return m->value = i;
+	}
+    }
+
+    if (ncheckdirs == acheckdirs &&
+	!(checkdirs = realloc(checkdirs, (acheckdirs *= 2) * sizeof *checkdirs)))
+	die("out of memory", 100);
+    if (*rel == '/' || !strcmp(checkdirs[parent].path, "."))
+	snprintf(path, sizeof path, "%s", rel);
+    else
+	snprintf(path, sizeof path, "%s/%s", checkdirs[parent].path, rel);
+    d = &checkdirs[ncheckdirs];
+    d->fd = fd;
+    d->dbfd = -2;
+    d->dev = st.st_dev;
+    d->ino = st.st_ino;
+    d->bits = 0;
+    d->base = 0;
+    if (!(d->path = strdup(path)))
+	die("out of memory", 100);
+    checkfds++;
+    return m->value = ncheckdirs++;
+}
+
+// split path relative to directory dir into a directory index and a
+// file name.  Returns -1 if the directory cannot be opened.
+static int
+checkdir_lookup(int dir, char *path, char **name)
+{
+    char *slash = strrchr(path, '/');
+
+    if (!slash) {
+	*name = path;
+	return dir;
+    }
+    *name = slash + 1;
+    if (slash == path)
+	return checkdir_open(dir, "/");
+    *slash = 0;
+    dir = checkdir_open(dir, path);
+    *slash = '/';
+    return dir;
+}
+
+// ctime of a file, -1 if it does not exist
+static int64_t
+check_ctime(int dir, struct memo *m)
+{
+    struct stat st;
+    int fd;
+
+    if (m->ctime == -2) {
+	count(M_STATS, 1);
+	fd = checkdir_fd(dir);
+	if (fd < 0 || fstatat(fd, m->name, &st, 0) < 0)
+	    m->ctime = -1;
+	else
+	    m->ctime = st.st_ctime;
+    }
+    return m->ctime;
+}
+
+// path of name in directory dir, for messages
+static char *
+check_path(int dir, const char *name)
+{
+    static _Thread_local char buf[2*PATH_MAX];
+    const char *d = checkdirs[dir].path;
+    if (!strcmp(d, "."))
+	return (char *)name;
+    snprintf(buf, sizeof buf, "%s/%s", d, name);
+    return buf;
+}
+
+// whether dependency file of checkdir dir is below a root in covered
+static int
+immutable_skip(int dir, const char *file, unsigned covered)
+{
+    int i;
+
+    if (!covered)
+	return 0;
+    i = immutable_root(*file == '/' ? file : check_path(dir, file));
+    return i >= 0 && (covered & (1u << i));
+}
+
+// read the whole dep file of name in directory dir, 0 if there is none
+static char *
+check_read_dep(int dir, const char *name, struct stat *st)
+{
+    char depname[PATH_MAX+8];
+    char *buf;
+    ssize_t r, len = 0;
+    int dbfd, fd;
+
+    dbfd = checkdir_db(dir);
+    if (dbfd < 0)
+	return 0;
+    snprintf(depname, sizeof depname, "%s.dep", name);
+    fd = openat(dbfd, depname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+	return 0;
+    if (fstat(fd, st) < 0 || !(buf = malloc(st->st_size + 1))) {
+	close(fd);
+	return 0;
+    }
+    // the dep file might grow, but we only care about what was there
+    while (len < st->st_size && (r = read(fd, buf + len, st->st_size - len)) > 0)
+	len += r;
+    close(fd);
+    buf[len] = 0;
+    return buf;
+}
+
+// batched stat and hash engine
+
+/*
+  With REDO_IO=threads or REDO_IO=uring, check_target() first looks at
+  all '=' dependencies of a dep file at once: their time stamps are
+  fetched in one batch, then the files which need hashing are read in
+  a second one.  On network file systems and with cold caches this
+  overlaps the latency of the single requests.  REDO_IO=uring submits
+  the batches to io_uring where available and falls back to a pool of
+  threads.  The walk over the dep file then finds the results in the
+  memos.
+*/
+
+#define IO_BATCH_MIN 4        // smaller batches are done one by one
+#define IO_THREADS_MAX 16
+
+struct io_item {
+    int fd;                   // directory handle
+    struct memo *m;
+    int file_fd;              // file being hashed by io_uring
+    off_t off;
+    char *buf;
+};
+
+// synchronous, also the work of one thread
+static void
+io_do(struct io_item *it, int hash)
+{
+    struct stat st;
+    int fd;
+
+    if (!hash) {
+	count(M_STATS, 1);
+	it->m->ctime = fstatat(it->fd, it->m->name, &st, 0) < 0 ? -1 : st.st_ctime;
+    } else {
+	fd = openat(it->fd, it->m->name, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+	    hashfile_r(fd, it->m->sum);
+	    close(fd);
+	}
+	it->m->hashed = fd >= 0 ? 1 : -1;
+    }
+}
+
+struct io_pool {
+    struct io_item *items;
+    int n, hash;
+    int next;                 // next item to take, atomic
+};
+
+static void *
+io_worker(void *arg)
+{
+    struct io_pool *p = arg;
+    int i;
+
+    while ((i = __sync_fetch_and_add(&p->next, 1)) < p->n)
+	io_do(&p->items[i], p->hash);
+    return 0;
+}
+
+static void
+io_threads(struct io_item *items, int n, int hash)
+{
+    pthread_t threads[IO_THREADS_MAX];
+    struct io_pool pool = { items, n, hash, 0 };
+    int i, nthreads = n < IO_THREADS_MAX ? n : IO_THREADS_MAX;
+
+    for (i = 0; i < nthreads; i++)
+	if (pthread_create(&threads[i], 0, io_worker, &pool) != 0)
+	    break;
+    nthreads = i;
+    io_worker(&pool);   // help, and do it all if no thread started
+    for (i = 0; i < nthreads; i++)
+	pthread_join(threads[i], 0);
+}
+
+#ifdef HAVE_URING
+
+#define URING_ENTRIES 256
+
+static struct {
+    int fd;
+    pid_t pid;                // a forked child sets up its own ring
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+} uring = { .fd = -1 };
+
+static int
+uring_setup()
+{
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    char *sq, *cq;
+    int fd;
+
+    if (uring.fd >= 0 && uring.pid == getpid())
+	return 1;
+    if (uring.fd >= 0)
+	close(uring.fd);
+    uring.fd = -1;
+    memset(&p, 0, sizeof p);
+    fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0)
+	return 0;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+	sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    sq = mmap(0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	      fd, IORING_OFF_SQ_RING);
+    cq = p.features & IORING_FEAT_SINGLE_MMAP ? sq :
+	mmap(0, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	     fd, IORING_OFF_CQ_RING);
+    uring.sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe),
+		      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		      fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || uring.sqes == MAP_FAILED) {
+	close(fd);
+	return 0;
+    }
+    uring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    uring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    uring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    uring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    uring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    uring.fd = fd;
+    uring.pid = getpid();
+    return 1;
+}
+
+static struct io_uring_sqe *
+uring_sqe(unsigned i, int op, int fd, uint64_t data)
+{
+    unsigned tail = *uring.sq_tail + i;
+    unsigned idx = tail & *uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[idx];
+
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = data;
+    uring.sq_array[idx] = idx;
+    return sqe;
+}
+
+// submit n prepared entries and wait for all of them, calls done for
+// each completion.  Returns 0 if io_uring failed.
+static int
+uring_run(unsigned n, void (*done)(struct io_item *, int), struct io_item *items)
+{
+    unsigned head, seen = 0;
+
+    __atomic_store_n(uring.sq_tail, *uring.sq_tail + n, __ATOMIC_RELEASE);
+    while (seen < n) {
+	if (syscall(__NR_io_uring_enter, uring.fd, seen ? 0 : n, n - seen,
+		    IORING_ENTER_GETEVENTS, 0, 0) < 0 && errno != EINTR)
+	    return 0;
+	head = *uring.cq_head;
+	while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+	    struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+	    done(&items[cqe->user_data], cqe->res);
+	    head++;
+	    seen++;
+	}
+	__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 1;
+}
+
+static void
+uring_statx_done(struct io_item *it, int res)
+{
+    struct statx *stx = (struct statx *)it->buf;
+    count(M_STATS, 1);
+    it->m->ctime = res < 0 ? -1 : stx->stx_ctime.tv_sec;
+}
+
+static void
+uring_open_done(struct io_item *it, int res)
+{
+    it->file_fd = res;
+    if (res < 0) {
+	it->m->hashed = -1;
+    } else {
+	count(M_HASHED, 1);
+	memcpy(it->m->sum, redo_siphash_key, 16);
+    }
+}
+
+static void
+uring_read_done(struct io_item *it, int res)
+{
+    if (res < 0) {
+	it->m->hashed = -1;
+    } else if (res == 0) {
+	if (it->off == 0)
+	    memcpy(it->m->sum, siphash_zero, 16);
+	it->m->hashed = 1;
+    } else {
+	hashblock(it->m->sum, it->buf, res);
+	it->off += res;
+    }
+    if (it->m->hashed) {
+	close(it->file_fd);
+	it->file_fd = -1;
+    }
+}
+
+static int
+io_uring(struct io_item *items, int n, int hash)
+{
+    int i, j, k;
+    char *bufs;
+
+    if (!uring_setup())
+	return 0;
+    // statx buffers, or read buffers
+    if (!(bufs = malloc((size_t)n * (hash ? 4096 : sizeof(struct statx)))))
+	return 0;
+    for (i = 0; i < n; i++) {
+	items[i].buf = bufs + (size_t)i * (hash ? 4096 : sizeof(struct statx));
+	items[i].file_fd = -1;
+	items[i].off = 0;
+    }
+
+    for (i = 0; i < n; i += URING_ENTRIES) {
+	int chunk = n - i < URING_ENTRIES ? n - i : URING_ENTRIES;
+	struct io_uring_sqe *sqe;
+
+	if (!hash) {
+	    for (j = 0; j < chunk; j++) {
+		sqe = uring_sqe(j, IORING_OP_STATX, items[i+j].fd, i+j);
+		sqe->addr = (uintptr_t)items[i+j].m->name;
+		sqe->len = STATX_CTIME;
+		sqe->off = (uintptr_t)items[i+j].buf;
+	    }
+	    if (!uring_run(chunk, uring_statx_done, items))
+		goto fail;
+	    continue;
+	}
+
+	for (j = 0; j < chunk; j++) {
+	    sqe = uring_sqe(j, IORING_OP_OPENAT, items[i+j].fd, i+j);
+	    sqe->addr = (uintptr_t)items[i+j].m->name;
+	    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+	}
+	if (!uring_run(chunk, uring_open_done, items))
+	    goto fail;
+	// read all open files block by block, one round per block
+	while (1) {
+	    for (j = k = 0; j < chunk; j++) {
+		struct io_item *it = &items[i+j];
+		if (it->file_fd < 0)
+		    continue;
+		sqe = uring_sqe(k++, IORING_OP_READ, it->file_fd, i+j);
+		sqe->addr = (uintptr_t)it->buf;
+		sqe->len = 4096;
+		sqe->off = it->off;
+	    }
+	    if (!k)
 		break;
-	    case '!':  // always rebuild
+	    if (!uring_run(k, uring_read_done, items))
+		goto fail;
+	}
+    }
+    free(bufs);
+    return 1;
+
+fail:
+    for (i = 0; i < n; i++)
+	if (items[i].file_fd >= 0)
+	    close(items[i].file_fd);
+    free(bufs);
+    close(uring.fd);
+    uring.fd = -1;
+    return 0;
+}
+
+#else
+
+static int
+io_uring(struct io_item *items, int n, int hash)
+{
+    (void)items; (void)n; (void)hash;
+    return 0;
+}
+
+#endif
+
+static void
+io_batch(struct io_item *items, int n, int hash)
+{
+    int i;
+
+    if (n < IO_BATCH_MIN) {
+	for (i = 0; i < n; i++)
+	    io_do(&items[i], hash);
+    } else if (io_mode == IO_URING && io_uring(items, n, hash)) {
+	return;
+    } else {
+	if (io_mode == IO_URING && dflag)
+	    fprintf(stderr, "io_uring not available, using threads\n");
+	if (io_mode == IO_URING)
+	    io_mode = IO_THREADS;
+	io_threads(items, n, hash);
+    }
+}
+
+// Look at all '=' dependencies in deps at once: fetch the time stamps
+// not known yet, then hash the files whose time stamp matches but
+// changed in the second the job of the dep file (st) started, or
+// later.  Those
+// below the roots in immutable are skipped.
+static void
+io_prefetch(int dir, char *deps, struct stat *st, unsigned immutable)
+{
+    struct io_item *items = 0, *batch;
+    uint64_t *stamps = 0;
+    char *line, *end, *name, c;
+    int n = 0, a = 0, i, j, d;
+
+    checkpin = 1;   // the handles in items must stay open
+    for (line = deps; *line && checkfds < 2*CHECK_FDS; line = end + !!c) {
+	if (!(end = strchr(line, '\n')))
+	    end = strchr(line, 0);
+	c = *end;
+	if (*line != '=' || end - line <= 1 + HASH_CHARS + 1 + 16 + 1)
+	    continue;
+	*end = 0;
+	name = line + 1 + HASH_CHARS + 1 + 16 + 1;
+	if (immutable_skip(dir, name, immutable))
+	    d = -1;
+	else
+	    d = checkdir_lookup(dir, name, &name);
+	if (d >= 0) {
+	    struct memo *m = memo_get(d, 'f', name);
+	    if (m->hashed == 0) {
+		if (n == a &&
+		    (!(items = realloc(items, (a = a ? 2*a : 64) * sizeof *items)) ||
+		     !(stamps = realloc(stamps, a * sizeof *stamps))))
+		    die("out of memory", 100);
+		m->hashed = 2;   // queued, also skips duplicates
+		items[n].m = m;
+		items[n].fd = checkdir_fd(d);
+		stamps[n] = strtoull(line + 1 + HASH_CHARS + 1, 0, 16);
+		if (items[n].fd >= 0)
+		    n++;
+		else
+		    m->hashed = 0;
+	    }
+	}
+	*end = c;
+    }
+
+    if (!n || !(batch = malloc(n * sizeof *batch)))
+	goto done;
+    for (i = j = 0; i < n; i++)
+	if (items[i].m->ctime == -2)
+	    batch[j++] = items[i];
+    io_batch(batch, j, 0);
+
+    for (i = j = 0; i < n; i++) {
+	struct memo *m = items[i].m;
+	m->hashed = 0;
+	// tracked files are looked up in the git index by check_target()
+	if (!git_mode && m->ctime >= 0 && (uint64_t)m->ctime == stamps[i] &&
+	    m->ctime >= st->st_mtime)
+	    batch[j++] = items[i];
+    }
+    io_batch(batch, j, 1);
+    free(batch);
+
+done:
+    for (i = 0; i < n; i++)
+	if (items[i].m->hashed == 2)
+	    items[i].m->hashed = 0;
+    checkpin = 0;
+    free(items);
+    free(stamps);
+}
+
+// files verified by other processes
+
+/*
+  Each nested redo-ifchange is a process of its own, with memos of its
+  own, and would check the headers and generated files shared by many
+  targets again.  A file found up to date, or a target built, is
+  published in a table in the shared region of the build, keyed by the
+  128 bit hash of its directory's device and inode and its name.
+  check_file() looks a file up there before it checks it.  Like with
+  the memos, a file changed during the build by something else than
+  its .do file goes unnoticed.  Except by the .do file calling us:
+  when it calls redo-ifchange again, it may have changed files since
+  the last call, below its directory and that of its target.  Each
+  directory hashes to one of 64 bits, and an entry holds the bits of
+  the directories its check looked into, through all dependencies,
+  and of the directories above them up to the top of the build.  The
+  second call marks the bits of its directories as changed at the
+  current point of the build, which drops the entries with one of
+  these bits published by processes which started before, and no
+  others.  Directories out of the top one count as all bits.  The
+  table is of fixed size, open addressed, and only ever filled; when a
+  probe finds no free slot, the file is just not published.
+*/
+
+#define VERIFIED_PROBES 32
+static int verified_seq;   // of the table when we started, plus one;
+                           // 0 if we publish none
+static uint64_t check_dirs;   // bits of the check_file() calls under way
+
+static uint64_t
+verified_bit(dev_t dev, ino_t ino)
+{
+    char buf[sizeof dev + sizeof ino];
+
+    memcpy(buf, &dev, sizeof dev);
+    memcpy(buf + sizeof dev, &ino, sizeof ino);
+    return (uint64_t)1 << siphash2_4_128(buf, sizeof buf, redo_siphash_key)[0] % 64;
+}
+
+// the bits of directory fd and of those above it up to the top of
+// the build, 0 if it is not below the top
+static uint64_t
+verified_tree(int fd)
+{
+    struct stat st;
+    dev_t dev = 0;
+    ino_t ino = 0;
+    uint64_t bits = 0;
+    int up;
+
+    if ((fd = dup(fd)) < 0)
+	return 0;
+    // up to the root of the file system, which is its own ..
+    while (fstat(fd, &st) == 0 && !(st.st_dev == dev && st.st_ino == ino)) {
+	bits |= verified_bit(st.st_dev, st.st_ino);
+	if (st.st_dev == shared->verified_dev && st.st_ino == shared->verified_ino) {
+	    close(fd);
+	    return bits;
+	}
+	dev = st.st_dev;
+	ino = st.st_ino;
+	up = openat(fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	close(fd);
+	if ((fd = up) < 0)
+	    return 0;
+    }
+    close(fd);
+    return 0;
+}
+
+// the bits of checked directory dir, all of them if not publishing
+static uint64_t
+checkdir_bits(int dir)
+{
+    struct checkdir *d = &checkdirs[dir];
+    int fd;
+
+    if (!d->bits && (!verified_seq || (fd = checkdir_fd(dir)) < 0 ||
+		     !(d->bits = verified_tree(fd))))
+	d->bits = ~(uint64_t)0;
+    return d->bits;
+}
+
+// whether none of the directories of bits changed since seq
+static int
+verified_current(uint64_t bits, int seq)
+{
+    int b;
+
+    for (b = 0; b < 64; b++)
+	if (bits >> b & 1 && ((volatile int *)&shared->verified_bumped[b])[0] >= seq)
+	    return 0;
+    return 1;
+}
+
+// files in the directories of bits may have changed
+static void
+verified_bump(uint64_t bits)
+{
+    int seq = __sync_add_and_fetch(&shared->verified_seq, 1), b, old;
+
+    for (b = 0; b < 64; b++)
+	while (bits >> b & 1 && (old = shared->verified_bumped[b]) < seq &&
+	       !__sync_bool_compare_and_swap(&shared->verified_bumped[b], old, seq))
+	    ;
+}
+
+// the bit of directory path, all if it is not below the top
+static uint64_t
+verified_own(const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    uint64_t bits = 0;
+
+    if (fd >= 0 && verified_tree(fd) && fstat(fd, &st) == 0)
+	bits = verified_bit(st.st_dev, st.st_ino);
+    if (fd >= 0)
+	close(fd);
+    return bits ? bits : ~(uint64_t)0;
+}
+
+// a redo-ifchange process starts checking
+static void
+verified_start()
+{
+    struct stat st;
+    char *dp = getenv("REDO_DIRPREFIX");
+
+    if (!shared)
+	return;
+    if (shared_owner && stat(".", &st) == 0) {
+	shared->verified_dev = st.st_dev;
+	shared->verified_ino = st.st_ino;
+    }
+    if (!shared_owner && (my_slot < 0 || __sync_fetch_and_add(&shared->slot[my_slot].calls, 1)))
+	verified_bump(my_slot < 0 ? ~(uint64_t)0 :   // the caller is not known
+		      verified_own(".") | (dp && *dp ? verified_own(dp) : 0));   // $1 is in dp
+    verified_seq = shared->verified_seq + 1;
+}
+
+static void
+verified_key(dev_t dev, ino_t ino, const char *name, uint64_t key[2])
+{
+    char buf[sizeof dev + sizeof ino + PATH_MAX];
+    size_t len = strlen(name);
+
+    if (len > PATH_MAX)
+	len = PATH_MAX;
+    memcpy(buf, &dev, sizeof dev);
+    memcpy(buf + sizeof dev, &ino, sizeof ino);
+    memcpy(buf + sizeof dev + sizeof ino, name, len);
+    memcpy(key, siphash2_4_128(buf, sizeof dev + sizeof ino + len, redo_siphash_key), 16);
+    if (!key[0])
+	key[0] = 1;
+}
+
+// 1 and the bits of its check in dirs if key is published and current
+static int
+verified_get(const uint64_t key[2], uint64_t *dirs)
+{
+    unsigned i, n;
+    uint64_t k, bits;
+    int seq;
+
+    if (!verified_seq)
+	return 0;
+    for (n = 0, i = key[0] % VERIFIED; n < VERIFIED_PROBES; n++, i = (i + 1) % VERIFIED) {
+	if (!(k = ((volatile uint64_t *)&shared->verified[i].key)[0]))
+	    return 0;
+	if (k == key[0] && (seq = ((volatile int *)&shared->verified[i].seq)[0])) {
+	    __sync_synchronize();
+	    bits = shared->verified[i].dirs;
+	    if (shared->verified[i].check != key[1])
+		continue;
+	    __sync_synchronize();
+	    if (((volatile int *)&shared->verified[i].seq)[0] == seq &&
+		verified_current(bits, seq)) {
+		*dirs = bits;
+		return 1;
+	    }
+	}
+    }
+    return 0;
+}
+
+// publish key, checked by looking into the directories of bits dirs
+// since we started, unless one of them changed since
+static void
+verified_put(const uint64_t key[2], uint64_t dirs)
+{
+    unsigned i, n;
+
+    if (!verified_seq || !verified_current(dirs, verified_seq))
+	return;
+    for (n = 0, i = key[0] % VERIFIED; n < VERIFIED_PROBES; n++, i = (i + 1) % VERIFIED) {
+	if (__sync_bool_compare_and_swap(&shared->verified[i].key, 0, key[0])) {
+	    shared->verified[i].check = key[1];
+	    shared->verified[i].dirs = dirs;
+	    __sync_synchronize();
+	    shared->verified[i].seq = verified_seq;
+	    return;
+	}
+	if (shared->verified[i].key == key[0] && shared->verified[i].check == key[1]) {
+	    // an older entry is renewed, readers see either or neither
+	    shared->verified[i].seq = 0;
+	    __sync_synchronize();
+	    shared->verified[i].dirs = dirs;
+	    __sync_synchronize();
+	    shared->verified[i].seq = verified_seq;
+	    return;
+	}
+    }
+}
+
+static int check_file(int dir, char *name);
+static char **spawn_env(char **set, int n);
+
+static int check_depth;   // of check_file() calls
+static int check_build;   // redo_ifchange(): see always_build()
+
+// redo-always target dir/target of an older session is a dependency
+// of a target being checked: build it now, with a redo-ifchange of
+// its own, so the targets depending on it need a rebuild only when
+// its output changed.  1 if it succeeded
+static int
+always_build(int dir, char *target)
+{
+    char *argv[] = { (char *)"redo-ifchange", check_path(dir, target), 0 };
+    char *unset[] = { (char *)"REDO_DEP_FD" };   // not a dependency of ours
+    char **env = spawn_env(unset, 1);
+    pid_t pid;
+    int status, r;
+
+    changedir(dir_fd, 0);
+    if ((r = posix_spawn(&pid, "/proc/self/exe", 0, 0, argv, env)))
+	r = posix_spawnp(&pid, "redo-ifchange", 0, 0, argv, env);
+    if (r) {
+	fprintf(stderr, "redo: cannot run redo-ifchange %s: %s\n", argv[1], strerror(r));
+	return 0;
+    }
+    count(M_FORKS, 1);
+    while (waitpid(pid, &status, 0) < 0)
+	if (errno != EINTR)
+	    return 0;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// dependency m of directory dir was built while checking: whether it
+// still has the hash and time stamp of its record
+static int
+check_rebuilt(int dir, struct memo *m, const char *hash, const char *timestamp)
+{
+    struct stat st;
+    int fd = openat(checkdir_fd(dir), m->name, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+	if (fd >= 0)
+	    close(fd);
+	return 0;
+    }
+    m->ctime = st.st_ctime;
+    hashfile_git(fd, git_cwd, git_mode ? check_path(dir, m->name) : 0, m->sum);
+    m->hashed = 1;
+    close(fd);
+    return strtoull(timestamp, 0, 16) == (uint64_t)m->ctime &&
+	!strncmp(hash, hashtohex(m->sum), HASH_CHARS);
+}
+
+// All hashes of the dep file (st) of name matched, and were taken
+// after the second of the latest time stamp which needed them: date
+// the dep file to the second after it.  A dependency which changes
+// from now on gets a later time stamp, so the next check can rely on
+// time stamps alone again.  A dep file replaced meanwhile is left be.
+static void
+check_settle(int dir, const char *name, struct stat *st, time_t when)
+{
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { when, 0 } };
+    char depname[PATH_MAX+8];
+    struct stat now;
+    int fd;
+
+    snprintf(depname, sizeof depname, "%s.dep", name);
+    if ((fd = openat(checkdir_db(dir), depname, O_RDONLY | O_CLOEXEC)) < 0)
+	return;
+    if (fstat(fd, &now) == 0 && now.st_ino == st->st_ino &&
+	now.st_mtim.tv_sec == st->st_mtim.tv_sec &&
+	now.st_mtim.tv_nsec == st->st_mtim.tv_nsec)
+	futimens(fd, times);
+    close(fd);
+}
+
+// Note: HASH_CHARS depend on hash, and changes .dep file format
+// return true when target does not need a rebuild:
+// - if target is a sourcefile: it has no dep file and
+//   - exists, or, when REDO_FORCE is set to 0, has no dofile
+// - no "false" check succeeds
+// false (0) when:
+// - FORCE_REDO is set (>0)
+// - depfile cannot be opened for reading
+// - '-' line and dependency exists
+// - '=' line:
+//    - dependency does not exist
+//    - timestamp does not match, or, if the dependency changed in the
+//      same second its job started or later, the hash does not match
+//    - all dependencies are up-to date
+// - '+' line (output): like '=', without checking its dependencies
+// - '@' line: the target producing this output needs a rebuild
+// - '*' line: tree hash does not match
+// - '!' line, unless redo-always wrote it during this session
+// ('%' lines, the pool of the .do file, are not checked)
+// - any other character on first position of line
+// 2 when it was built while checking, see always_build()
+//
+// The dep file (st) is dated when its job started: a dependency which
+// changed in that second or later is hashed, see check_settle().
+static int
+check_target(int dir, char *target)
+{
+    struct memo *m = memo_get(dir, 'f', target);
+    struct stat st;
+    char *deps, *line, *next, *path = check_path(dir, target), *session;
+    int ok = 1, fd, built = 0;
+    int64_t racy = -1;   // latest time stamp that needed hashing
+    unsigned immutable;  // roots whose lines are skipped
+
+    count(M_CHECKED, 1);
+    deps = check_read_dep(dir, target, &st);
+    m->dep_ino = deps ? st.st_ino : 0;
+    if (!deps) {
+	if (fflag < 0 ? check_ctime(dir, m) >= 0
+	    : (fd = checkdir_fd(dir)) >= 0 && !find_dofile(fd, target)) {
+	    dprint2("Not rebuilt, is sourcefile: ", path);
+	    count(M_UPTODATE, 1);
+	    return 1;
+	}
+	if (fflag > 0)
+	    dprint2("Rebuild, force flag active: ", path);
+	else
+	    dprint2("Rebuild, depfile cannot be opened: ", path);
+	return 0;
+    }
+    if (fflag > 0) {
+	dprint2("Rebuild, force flag active: ", path);
+	free(deps);
+	return 0;
+    }
+    immutable = nimmutables ? immutable_covered(deps) : 0;
+    if (io_mode != IO_SYNC)
+	io_prefetch(dir, deps, &st, immutable);
+
+    for (line = deps; ok && *line; line = next) {
+	char *hash = line + 1;
+	char *timestamp = line + 1 + HASH_CHARS + 1;
+	char *filename = line + 1 + HASH_CHARS + 1 + 16 + 1;
+	char *treehash, *name;
+	struct memo *dm;
+	int d = -1;
+
+	if ((next = strchr(line, '\n')))
+	    *next++ = 0;
+	else
+	    next = strchr(line, 0);
+	count(M_DEP_LINES, 1);
+
+	switch (line[0]) {
+	case '-':  // must not exist
+	    if (strchr(line + 1, '/'))   // in another directory
+		check_dirs |= (d = checkdir_lookup(dir, line + 1, &name)) < 0 ?
+		    ~(uint64_t)0 : checkdir_bits(d);
+	    if ((fd = checkdir_fd(dir)) < 0 || faccessat(fd, line+1, F_OK, 0) == 0) {
 		// Note: better message needed
+		dprint4("Rebuild, dependency ", line+1, " must not exist: ", path);
+		ok = 0;
+	    }
+	    break;
+	case '+':  // an output, like '=' but not built by itself
+	case '=':  // compare timestamp, and hash if needed
+	    if (*line == '=' && strlen(line) >= (size_t)(filename - line) &&
+		immutable_skip(dir, filename, immutable))
+		break;   // below an immutable root, see immutable_covered()
+	    if (strlen(line) < (size_t)(filename - line) ||
+		(d = checkdir_lookup(dir, filename, &name)) < 0 ||
+		check_ctime(d, dm = memo_get(d, 'f', name)) < 0) {
+		dprint4("Rebuild, cannot open dependency ", filename, " for reading: ", path);
+		ok = 0;
+	    } else if (strtoull(timestamp, 0, 16) != (uint64_t)dm->ctime) {
+		ok = 0;
+		dprint4("Rebuild, timestamp mismatch for ", filename, ": ", path);
+	    } else if (dm->ctime >= st.st_mtime) {
+		// changed in the second the job started, which dates the
+		// dep file, or later: it may have changed again after it
+		// was recorded, the time stamp alone cannot tell
+		racy = dm->ctime > racy ? dm->ctime : racy;
+		if (!dm->hashed) {
+		    fd = openat(checkdir_fd(d), name, O_RDONLY | O_CLOEXEC);
+		    dm->hashed = fd < 0 ? -1 : 1;
+		    if (fd >= 0) {
+			hashfile_git(fd, git_cwd, git_mode ? check_path(d, name) : 0, dm->sum);
+			close(fd);
+		    }
+		}
+		if (dm->hashed < 0 ||
+		    strncmp(hash, hashtohex(dm->sum), HASH_CHARS) != 0) {
+		    ok = 0;
+		    dprint4("Rebuild, hash mismatch for ", filename, ": ", path);
+		}
+	    }
+	    if (d >= 0)   // see verified_put()
+		check_dirs |= checkdir_bits(d);
+	    // hash is good, recurse into dependencies
+	    if (ok && *line == '=' && !(d == dir && strcmp(target, name) == 0)) {
+		ok = check_file(d, name);
+		if (!ok) {
+		    dprint4("Rebuild, dependency needs rebuild for ", filename, ": ", path);
+		} else if (dm->value == CHECK_BUILT && !check_rebuilt(d, dm, hash, timestamp)) {
+		    ok = 0;
+		    dprint4("Rebuild, dependency changed when built for ", filename, ": ", path);
+		}
+	    }
+	    break;
+	case '*':  // compare tree hash
+	    check_dirs |= ~(uint64_t)0;   // any directory below
+	    treehash = tree_hash(dir, filename);
+	    if (!treehash) {
+		ok = 0;
+		dprint4("Rebuild, cannot read dependency tree ", filename, ": ", path);
+	    } else if (strncmp(hash, treehash, HASH_CHARS) != 0) {
+		ok = 0;
+		dprint4("Rebuild, tree hash mismatch for ", filename, ": ", path);
+	    }
+	    break;
+	case '@':  // an output of another target, up to date with it
+	    if ((d = checkdir_lookup(dir, line + 1, &name)) < 0 || !check_file(d, name)) {
 		ok = 0;
-		dprint2("Rebuild, forced by ! line: ", target);
+		dprint4("Rebuild, producing target needs rebuild ", line + 1, ": ", path);
+	    }
+	    break;
+	case '%':  // the pool of the .do file, see redo_pool()
+	    break;
+	case '!':  // always rebuild, redo-always once per session
+	    if (line[1] && (session = getenv("REDO_SESSION")) && !strcmp(line + 1, session))
+		break;
+	    if (line[1] && check_build && check_depth > 1) {
+		dprint2("Build now, redo-always of an older session: ", path);
+		if ((built = always_build(dir, target)))
+		    next = strchr(next, 0);   // the old records are done with
+		else
+		    ok = 0;
+		break;
+	    }
+	    // Note: better message needed
+	    ok = 0;
+	    dprint2("Rebuild, forced by ! line: ", path);
+	    break;
+	default:  // dep file broken, lets recreate it
+	    ok = 0;
+	    dprint2("Rebuild, invalid dep file line: ", path);
+	}
+    }
+    free(deps);
+    if (built) {
+	m->ctime = -2;
+	m->hashed = 0;
+	return 2;
+    }
+
+    if (ok && racy >= 0 && racy < check_since && !db_readonly)
+	check_settle(dir, target, &st, racy + 1);
+    if (ok) {
+	dprint2("Not rebuilt, already up-to-date: ", path);
+	count(M_UPTODATE, 1);
+    }
+    return ok;
+}
+
+// check each file once, dependency cycles are broken by assuming the
+// file in question is fine
+static int
+check_file(int dir, char *name)
+{
+    struct memo *m = memo_get(dir, 'f', name);
+    uint64_t key[2], outer;
+    int r;
+
+    if (m->value == CHECK_UNKNOWN) {
+	verified_key(checkdirs[dir].dev, checkdirs[dir].ino, name, key);
+	if (fflag <= 0 && verified_get(key, &m->dirs)) {
+	    count(M_VERIFIED_HITS, 1);
+	    m->value = CHECK_OK;
+	    check_dirs |= m->dirs;
+	    return 1;
+	}
+	outer = check_dirs;
+	check_dirs = checkdir_bits(dir);
+	m->value = CHECK_BUSY;
+	check_depth++;
+	r = check_target(dir, name);
+	check_depth--;
+	m->value = r > 1 ? CHECK_BUILT : r ? CHECK_OK : CHECK_REBUILD;
+	m->dirs = check_dirs;
+	check_dirs |= outer;
+	if (m->value == CHECK_OK)
+	    verified_put(key, m->dirs);
+    } else {
+	check_dirs |= m->dirs;
+    }
+    return m->value != CHECK_REBUILD;
+}
+
+// target is relative to the working directory
+static int
+check_deps(char *target)
+{
+    char *name;
+    int dir;
+
+    checkdir_root();
+    dir = checkdir_lookup(0, target, &name);
+    if (dir < 0) {
+	dprint2("Rebuild, cannot open directory of: ", target);
+	return 0;
+    }
+    return check_file(dir, name);
+}
+
+char uprel[PATH_MAX];
+
+void
+compute_uprel()
+{
+    char *u = uprel;
+    char *dp = getenv("REDO_DIRPREFIX");
+
+    *u = 0;
+    while (dp && *dp) {
+	*u++ = '.';
+	*u++ = '.';
+	*u++ = '/';
+	*u = 0;
+	dp = strchr(dp + 1, '/');
+    }
+}
+
+#define DEP_RECORD (2*PATH_MAX+64)
+
+// format the record of file into buf: type '=' for a dependency, '+'
+// for an output, named prefix and file unless file is absolute.
+// Returns its length, or 0 if file cannot be opened
+static int
+dep_record(char *buf, size_t size, char type, const char *prefix, char *file)
+{
+    uint8_t sum[16];
+    int n, fd = open(file, O_RDONLY);
+    if (fd < 0)
+	return 0;
+    n = snprintf(buf, size, "%c%s %s %s%s\n", type,
+		 hashtohex(hashfile_git(fd, 0, file, sum)),
+		 datefile(fd), (*file == '/' ? "" : prefix), file);
+    close(fd);
+    return n < 0 || (size_t)n >= size ? 0 : n;
+}
+
+static int
+write_dep(int dep_fd, char *file)
+{
+    char buf[DEP_RECORD];
+    int n = dep_record(buf, sizeof buf, '=', uprel, file), i;
+    if (n)
+	write(dep_fd, buf, n);
+    // once per process: the stamp of an immutable root
+    if (n && nimmutables && (i = immutable_root(file)) >= 0 &&
+	immutables[i].stamp && !immutables[i].recorded) {
+	immutables[i].recorded = 1;
+	write_dep(dep_fd, immutables[i].stamp);
+    }
+    return 0;
+}
+
+// dofile doesn't contain /
+// target can contain /
+static char *
+redo_basename(char *dofile, char *target)
+{
+    static _Thread_local char buf[PATH_MAX];
+    int stripext = 0;
+    char *s;
+
+    if (strncmp(dofile, "default.", 8) == 0)
+	for (stripext = -1, s = dofile; *s; s++)
+	    if (*s == '.')
+		stripext++;
+
+    strncpy(buf, target, sizeof buf);
+    while (stripext-- > 0) {
+	if (strchr(buf, '.')) {
+	    char *e = strchr(buf, '\0');
+	    while (*--e != '.')
+		*e = 0;
+	    *e = 0;
+	}
+    }
+
+    return buf;
+}
+
+// dependency tracing
+
+/*
+  With REDO_DEPTRACE=record, .do files are run with the LD_PRELOAD
+  shim redo-trace.so (REDO_DEPTRACE_LIB, or next to the redo binary),
+  which reports the files they open and the missing files they probe
+  to a temporary file.  When the job succeeds, files it read become
+  '=' records and missing files '-' records, besides those declared
+  with redo-ifchange and redo-ifcreate.  Files the job wrote,
+  directories, database files and paths below REDO_DEPTRACE_IGNORE
+  are left out.  Both record and report tell about files read but not
+  declared, and files declared but not read.  report records nothing.
+*/
+
+enum { DEPTRACE_OFF, DEPTRACE_REPORT, DEPTRACE_RECORD };
+static int deptrace;
+static char deptrace_preload[2*PATH_MAX];   // "LD_PRELOAD=..."
+static const char *deptrace_ignore = "/dev /proc /sys /etc/ld.so.cache";
+
+// pick up REDO_DEPTRACE: off (default), report or record
+static void
+setup_deptrace()
+{
+    char *s = getenv("REDO_DEPTRACE"), *lib = getenv("REDO_DEPTRACE_LIB");
+    char *preload = getenv("LD_PRELOAD"), exe[PATH_MAX], path[PATH_MAX+16], *slash;
+    ssize_t r;
+
+    if (!s || !*s || !strcmp(s, "off"))
+	return;
+    if (!strcmp(s, "record"))
+	deptrace = DEPTRACE_RECORD;
+    else if (!strcmp(s, "report"))
+	deptrace = DEPTRACE_REPORT;
+    else
+	die2("invalid REDO_DEPTRACE, use off, report or record", s, 111);
+    if ((s = getenv("REDO_DEPTRACE_IGNORE")))
+	deptrace_ignore = s;
+    if (!lib || !*lib) {
+	r = readlink("/proc/self/exe", exe, sizeof exe - 1);
+	exe[r > 0 ? r : 0] = 0;
+	slash = strrchr(exe, '/');
+	snprintf(path, sizeof path, "%.*sredo-trace.so", slash ? (int)(slash + 1 - exe) : 0, exe);
+	lib = path;
+    }
+    if (access(lib, R_OK) < 0)
+	die2("REDO_DEPTRACE: cannot load", lib, 111);
+    // nested .do files inherit it
+    if (preload && strstr(preload, lib))
+	snprintf(deptrace_preload, sizeof deptrace_preload, "LD_PRELOAD=%s", preload);
+    else
+	snprintf(deptrace_preload, sizeof deptrace_preload, "LD_PRELOAD=%s%s%s", lib,
+		 preload && *preload ? " " : "", preload ? preload : "");
+}
+
+// the trace file of a job, -1 on error
+static int
+deptrace_open(char *target)
+{
+    char path[2*PATH_MAX+48];
+    int fd = open_tmpfile(redo_base(target), 0, 0600);
+
+    if (fd < 0) {
+	snprintf(path, sizeof path, "%s.trace", targettmp(".tmp", getpid(), target));
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) >= 0)
+	    unlink(path);
+    }
+    // written by all processes of the job
+    if (fd >= 0)
+	fcntl(fd, F_SETFL, O_APPEND);
+    return fd;
+}
+
+// the contents of file fd, 0 terminated
+static char *
+deptrace_read(int fd)
+{
+    struct stat st;
+    char *buf = 0;
+    ssize_t r = -1;
+
+    if (fstat(fd, &st) == 0 && (buf = malloc(st.st_size + 1)))
+	r = pread(fd, buf, st.st_size, 0);
+    if (r < 0) {
+	free(buf);
+	return 0;
+    }
+    buf[r] = 0;
+    return buf;
+}
+
+struct access {
+    char *path;   // absolute
+    char kind;    // 'r', 'w', 'm' traced; '=', '-' declared
+};
+
+static int
+access_cmp(const void *a, const void *b)
+{
+    const struct access *x = a, *y = b;
+    int c = strcmp(x->path, y->path);
+    return c ? c : x->kind - y->kind;
+}
+
+// add the accesses in buf, lines of kind and path relative to dir
+static void
+access_add(struct access **v, int *n, int *a, char *buf, const char *dir)
+{
+    char *line, *next, *path, abs[2*PATH_MAX];
+
+    for (line = buf; line && *line; line = next) {
+	if ((next = strchr(line, '\n')))
+	    *next++ = 0;
+	if (strchr("rwm", *line) && line[1] == ' ')
+	    path = line + 2;   // traced
+	else if (*line == '=' && strlen(line) > 1 + HASH_CHARS + 1 + 16 + 1)
+	    path = line + 1 + HASH_CHARS + 1 + 16 + 1;
+	else if (*line == '-')
+	    path = line + 1;
+	else
+	    continue;
+	if (*n == *a && !(*v = realloc(*v, (*a = *a ? 2 * *a : 64) * sizeof **v)))
+	    die("out of memory", 100);
+	db_path(dir, path, abs, sizeof abs);
+	if (!((*v)[*n].path = strdup(abs)))
+	    die("out of memory", 100);
+	(*v)[(*n)++].kind = *line;
+    }
+}
+
+// whether the traced path is none of our business
+static int
+deptrace_ignored(const char *path)
+{
+    const char *s = deptrace_ignore, *base = strrchr(path, '/');
+    size_t len;
+
+    if (strstr(path, "/.redo/") || (base && !strncmp(base, "/.redo.", 7)) ||
+	(db_dir && !strncmp(path, db_dir, strlen(db_dir)) && path[strlen(db_dir)] == '/'))
+	return 1;
+    for (; *s; s += len) {
+	s += strspn(s, " ");
+	len = strcspn(s, " ");
+	if (len && !strncmp(path, s, len) && (path[len] == '/' || !path[len] || s[len-1] == '/'))
+	    return 1;
+    }
+    return 0;
+}
+
+// path relative to directory dir if both are below the same top level
+// directory, absolute otherwise; both are absolute and lexically clean
+static const char *
+deptrace_rel(const char *dir, const char *path, char *out, size_t size)
+{
+    size_t i, common = 0, len = 0;
+
+    // the longest common directory
+    for (i = 0; dir[i] && dir[i] == path[i]; i++)
+	if (dir[i] == '/')
+	    common = i;
+    if (!dir[i] && (path[i] == '/' || !path[i]))
+	common = i;   // path is dir, or below it
+    if (!common)
+	return path;
+    *out = 0;
+    for (i = common; dir[i]; i++)
+	if (dir[i] == '/')
+	    len += snprintf(out + len, size - len, "../");
+    snprintf(out + len, size - len, "%s", path[common] ? path + common + 1 : ".");
+    return out;
+}
+
+// the job of target in the current directory succeeded: add the
+// traced accesses to its dep file dfd, and report how they differ
+// from the declared ones in dfd and deprec.  Files are hashed by
+// their absolute paths; only the names recorded are relative, to the
+// current directory, which job_commit() set to that of target for
+// this thread
+static void
+deptrace_commit(int trace_fd, int dfd, char *target, const char *deprec)
+{
+    char cwd[PATH_MAX], self[2*PATH_MAX], rel[2*PATH_MAX], rec[DEP_RECORD];
+    char *trace, *deps, *dofile;
+    const char *p;
+    struct access *v = 0;
+    struct stat st;
+    int n = 0, a = 0, i, j, len, undeclared = 0, unused = 0;
+
+    if (!getcwd(cwd, sizeof cwd) || !(trace = deptrace_read(trace_fd)))
+	return;
+    if (!(deps = deptrace_read(dfd)) || !(dofile = strdup(deprec))) {
+	free(trace);
+	return;
+    }
+    access_add(&v, &n, &a, trace, "");
+    access_add(&v, &n, &a, deps, cwd);
+    access_add(&v, &n, &a, dofile, cwd);
+    qsort(v, n, sizeof *v, access_cmp);
+    db_path(cwd, target, self, sizeof self);
+
+    lseek(dfd, 0, SEEK_END);
+    for (i = 0; i < n; i = j) {
+	int read = 0, wrote = 0, missing = 0, declared = 0, depends = 0;
+	for (j = i; j < n && !strcmp(v[j].path, v[i].path); j++) {
+	    read |= v[j].kind == 'r';
+	    wrote |= v[j].kind == 'w';
+	    missing |= v[j].kind == 'm';
+	    depends |= v[j].kind == '=';
+	    declared |= v[j].kind == '=' || v[j].kind == '-';
+	}
+	if (wrote || !strcmp(v[i].path, self) || deptrace_ignored(v[i].path))
+	    continue;
+	if (depends && !read) {
+	    unused++;
+	    dprint4("Declared, but not read by ", target, ": ", v[i].path);
+	}
+	if (declared || !(read || missing))
+	    continue;
+	p = deptrace_rel(cwd, v[i].path, rel, sizeof rel);
+	if (read && stat(v[i].path, &st) == 0 && S_ISREG(st.st_mode)) {
+	    undeclared++;
+	    dprint4("Read, but not declared by ", target, ": ", v[i].path);
+	    // "=hash stamp " of the absolute path, then the relative one
+	    if (deptrace == DEPTRACE_RECORD &&
+		(len = dep_record(rec, sizeof rec, '=', "", v[i].path)) > 1 + HASH_CHARS + 1 + 16 + 1) {
+		len = 1 + HASH_CHARS + 1 + 16 + 1;
+		len += snprintf(rec + len, sizeof rec - len, "%s\n", p);
+		if ((size_t)len < sizeof rec)
+		    write(dfd, rec, len);
+	    }
+	} else if (!read && *p != '/' && strncmp(p, "../", 3) && lstat(v[i].path, &st) < 0) {
+	    // probes below this directory only, not every $PATH lookup
+	    if (deptrace == DEPTRACE_RECORD)
+		dprintf(dfd, "-%s\n", p);
+	}
+    }
+    if (undeclared || unused)
+	fprintf(stderr, "redo: %s: %d files read but not declared%s, %d declared but not read\n",
+		target, undeclared, deptrace == DEPTRACE_RECORD ? " (recorded)" : "", unused);
+
+    for (i = 0; i < n; i++)
+	free(v[i].path);
+    free(v);
+    free(dofile);
+    free(deps);
+    free(trace);
+}
+
+// workers
+
+/*
+  run_script() starts a .do file as a child of the redo which needs
+  it.  With REDO_WORKERS="SOCKET..", it starts a small client in its
+  place, redo-worker --job, which hands the job to one of the worker
+  daemons listening on the unix sockets, started by redo-worker
+  SOCKET.  The client relays what comes back, and exits with the
+  status of the job, so redo waits for it like for any .do file.
+
+  Both sides send frames, a line "NAME LENGTH" followed by LENGTH
+  bytes.  The client sends the job: "cwd", an "arg" for each
+  argument, an "env" for each variable, "direct" when the .do file is
+  executed itself rather than by /bin/sh, an "input" with the hash
+  and the name of the .do file, and "run".  The worker checks the
+  inputs against its view of the files, runs the job and streams
+  "out" (its stdout, the output), "err" (its stderr), then "dep" (the
+  records it wrote to REDO_DEP_FD) and "exit" with its status.
+
+  A worker shares the file system with redo: the job runs in the
+  same directory, and writes $3 in place.  File descriptors are not
+  passed on, so redo processes called by a job on a worker are builds
+  of their own, with a shared region of their own, but in the session
+  of the build, and one job at a time: the job holds one of the build.
+  REDO_DEPTRACE does not see jobs on workers.
+*/
+
+static char *workers[16];   // REDO_WORKERS: socket paths
+static int nworkers;
+
+static void
+setup_workers()
+{
+    static char buf[4096];
+    char *s = getenv("REDO_WORKERS"), *w;
+
+    if (!s || !*s)
+	return;
+    snprintf(buf, sizeof buf, "%s", s);
+    for (w = strtok(buf, " "); w && nworkers < 16; w = strtok(0, " "))
+	workers[nworkers++] = w;
+}
+
+// a stream of frames
+struct frames {
+    int fd;
+    size_t off, len;
+    char buf[65536];
+};
+
+static int
+write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t r;
+
+    while (len > 0) {
+	if ((r = write(fd, buf, len)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	buf += r;
+	len -= r;
+    }
+    return 0;
+}
+
+static int
+frame_write(int fd, const char *name, const char *data, size_t len)
+{
+    char head[64];
+    int n = snprintf(head, sizeof head, "%s %zu\n", name, len);
+    return write_all(fd, head, n) < 0 || write_all(fd, data, len) < 0 ? -1 : 0;
+}
+
+// the next frame of f: its name, and *len bytes in *data, malloc'ed
+// and 0 terminated.  0 at the end of the stream or on errors
+static int
+frame_read(struct frames *f, char name[16], char **data, size_t *len)
+{
+    char head[64];
+    size_t n = 0, got = 0, k;
+    ssize_t r;
+
+    for (;;) {
+	if (f->off == f->len) {
+	    if ((r = read(f->fd, f->buf, sizeof f->buf)) < 0 && errno == EINTR)
+		continue;
+	    if (r <= 0)
+		return 0;
+	    f->off = 0;
+	    f->len = r;
+	}
+	if (f->buf[f->off] == '\n')
+	    break;
+	if (n == sizeof head - 1)
+	    return 0;
+	head[n++] = f->buf[f->off++];
+    }
+    f->off++;
+    head[n] = 0;
+    if (sscanf(head, "%15s %zu", name, len) != 2 || *len > (1 << 30))
+	return 0;
+    if (!(*data = malloc(*len + 1)))
+	die("out of memory", 100);
+    while (got < *len) {
+	if (f->off < f->len) {
+	    k = MIN(f->len - f->off, *len - got);
+	    memcpy(*data + got, f->buf + f->off, k);
+	    f->off += k;
+	} else if ((r = read(f->fd, *data + got, *len - got)) > 0) {
+	    k = r;
+	} else if (r < 0 && errno == EINTR) {
+	    continue;
+	} else {
+	    free(*data);
+	    return 0;
+	}
+	got += k;
+    }
+    (*data)[*len] = 0;
+    return 1;
+}
+
+// file descriptors of ours, which mean nothing to a worker, and the
+// job limit, which the worker sets
+static int
+worker_local(const char *env)
+{
+    static const char *const local[] = {
+	"REDO_RD_FD=", "REDO_WR_FD=", "REDO_SHM_FD=", "REDO_SLOT=", "REDO_DEP_FD=",
+	"REDO_DEPTRACE_FD=", "JOBS=", 0
+    };
+    int i;
+
+    for (i = 0; local[i]; i++)
+	if (!strncmp(env, local[i], strlen(local[i])))
+	    return 1;
+    return 0;
+}
+
+// redo-worker --job N [--direct] ARGS..: run the job ARGS on a worker,
+// starting with the Nth one
+static void
+worker_client(int argc, char *argv[])
+{
+    struct frames *f;
+    struct sockaddr_un addr;
+    char name[16], *data, cwd[PATH_MAX], input[PATH_MAX+64];
+    const char *dofile;
+    size_t len;
+    int i, fd = -1, start, direct = 0, out_dep;
+
+    setup_workers();
+    if (argc < 2 || !nworkers)
+	die("redo-worker --job: no job, or REDO_WORKERS not set", 111);
+    start = atoi(argv[1]);
+    argc -= 2;
+    argv += 2;
+    if (argc > 0 && !strcmp(*argv, "--direct")) {
+	direct = 1;
+	argc--;
+	argv++;
+    }
+    dofile = direct ? argv[0] : argv[2];
+
+    for (i = 0; i < nworkers && fd < 0; i++) {
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof addr.sun_path, "%s", workers[(start + i) % nworkers]);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+	    die("socket", 111);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+	    close(fd);
+	    fd = -1;
+	}
+    }
+    if (fd < 0)
+	die2("redo-worker: no worker to run", dofile, 111);
+
+    if (!getcwd(cwd, sizeof cwd))
+	die("getcwd", 100);
+    if ((i = open(dofile, O_RDONLY | O_CLOEXEC)) < 0)
+	die2("redo-worker: cannot open", dofile, 111);
+    len = snprintf(input, sizeof input, "%s %s", hashtohex(hashfile(i)), dofile);
+    close(i);
+    frame_write(fd, "cwd", cwd, strlen(cwd));
+    for (i = 0; i < argc; i++)
+	frame_write(fd, "arg", argv[i], strlen(argv[i]));
+    for (i = 0; environ[i]; i++)
+	if (!worker_local(environ[i]))
+	    frame_write(fd, "env", environ[i], strlen(environ[i]));
+    if (direct)
+	frame_write(fd, "direct", "", 0);
+    frame_write(fd, "input", input, len);
+    if (frame_write(fd, "run", "", 0) < 0)
+	die2("redo-worker: cannot send", dofile, 111);
+
+    out_dep = envfd("REDO_DEP_FD");
+    if (!(f = malloc(sizeof *f)))
+	die("out of memory", 100);
+    f->fd = fd;
+    f->off = f->len = 0;
+    while (frame_read(f, name, &data, &len)) {
+	if (!strcmp(name, "out"))
+	    write_all(1, data, len);
+	else if (!strcmp(name, "err"))
+	    write_all(2, data, len);
+	else if (!strcmp(name, "dep") && out_dep >= 0)
+	    write_all(out_dep, data, len);
+	else if (!strcmp(name, "exit"))
+	    exit(atoi(data));
+	free(data);
+    }
+    die2("redo-worker: connection lost running", dofile, 111);
+}
+
+// run the job sent over connection conn, see worker_client()
+static void
+worker_run(int conn, const char *sock)
+{
+    struct frames *f;
+    struct pollfd pfd[2];
+    char name[16], *data, *cwd = 0, **args = 0, **env = 0, buf[65536], tmp[PATH_MAX];
+    const char *dir = getenv("TMPDIR");
+    size_t len, aargs = 0, aenv = 0, nargs = 0, nenv = 0;
+    ssize_t r;
+    int direct = 0, dfd, out[2], err[2], status, n;
+    pid_t pid;
+
+    if (!(f = malloc(sizeof *f)))
+	die("out of memory", 100);
+    f->fd = conn;
+    f->off = f->len = 0;
+    while (frame_read(f, name, &data, &len) && strcmp(name, "run")) {
+	if (!strcmp(name, "cwd")) {
+	    cwd = data;
+	} else if (!strcmp(name, "arg")) {
+	    // room for /bin/sh -e in front, and the terminating 0
+	    if (nargs + 3 >= aargs &&
+		!(args = realloc(args, (aargs = 2 * aargs + 16) * sizeof *args)))
+		die("out of memory", 100);
+	    args[nargs++] = data;
+	} else if (!strcmp(name, "env") && !worker_local(data)) {
+	    // room for the variables set below, and the terminating 0
+	    if (nenv + 4 >= aenv &&
+		!(env = realloc(env, (aenv = 2 * aenv + 64) * sizeof *env)))
+		die("out of memory", 100);
+	    env[nenv++] = data;
+	} else if (!strcmp(name, "direct")) {
+	    direct = 1;
+	} else if (!strcmp(name, "input") && cwd && !chdir(cwd)) {
+	    char *path = strchr(data, ' ');
+	    int fd = path ? open(path + 1, O_RDONLY | O_CLOEXEC) : -1;
+	    if (fd < 0 || strncmp(data, hashtohex(hashfile(fd)), HASH_CHARS)) {
+		n = snprintf(buf, sizeof buf, "redo-worker %s: input differs: %s\n",
+			     sock, path ? path + 1 : data);
+		frame_write(conn, "err", buf, n);
+		frame_write(conn, "exit", "111", 3);
+		_exit(111);
+	    }
+	    close(fd);
+	}
+    }
+    if (strcmp(name, "run") || !nargs || !cwd || chdir(cwd) < 0)
+	_exit(111);
+    if (!env && !(env = calloc(4, sizeof *env)))
+	die("out of memory", 100);
+
+    snprintf(tmp, sizeof tmp, "%s/redo-worker.XXXXXX", dir && *dir ? dir : "/tmp");
+    if ((dfd = mkstemp(tmp)) < 0 || pipe(out) < 0 || pipe(err) < 0)
+	die("redo-worker: no temporary file or pipe", 111);
+    unlink(tmp);
+    snprintf(buf, sizeof buf, "REDO_DEP_FD=%d", dfd);
+    env[nenv++] = strdup(buf);
+    snprintf(buf, sizeof buf, "REDO_WORKER=%s", sock);
+    env[nenv++] = strdup(buf);
+    env[nenv++] = (char *)"JOBS=1";
+    env[nenv] = 0;
+    args[nargs] = 0;
+
+    if ((pid = fork()) == 0) {
+	dup2(out[1], 1);
+	dup2(err[1], 2);
+	close(out[0]);
+	close(out[1]);
+	close(err[0]);
+	close(err[1]);
+	close(conn);
+	if (direct) {
+	    execve(args[0], args, env);
+	    if (errno != ENOEXEC && errno != EACCES)
+		_exit(127);
+	    memmove(args + 2, args, (nargs + 1) * sizeof *args);
+	    args[0] = (char *)"/bin/sh";
+	    args[1] = (char *)"-e";
+	}
+	execve("/bin/sh", args, env);
+	_exit(127);
+    }
+    close(out[1]);
+    close(err[1]);
+    if (pid < 0)
+	die("fork", 111);
+
+    // stdout and stderr as they come
+    pfd[0].fd = out[0];
+    pfd[1].fd = err[0];
+    pfd[0].events = pfd[1].events = POLLIN;
+    while (pfd[0].fd >= 0 || pfd[1].fd >= 0) {
+	if (poll(pfd, 2, -1) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+	for (n = 0; n < 2; n++) {
+	    if (pfd[n].fd < 0 || !pfd[n].revents)
+		continue;
+	    if ((r = read(pfd[n].fd, buf, sizeof buf)) > 0) {
+		frame_write(conn, n ? "err" : "out", buf, r);
+	    } else if (r == 0 || errno != EINTR) {
+		close(pfd[n].fd);
+		pfd[n].fd = -1;
+	    }
+	}
+    }
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+	;
+    status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+    if ((data = deptrace_read(dfd))) {
+	frame_write(conn, "dep", data, strlen(data));
+	free(data);
+    }
+    n = snprintf(buf, sizeof buf, "%d", status);
+    frame_write(conn, "exit", buf, n);
+    _exit(0);
+}
+
+// start the client of job argv, to run it on a worker, the first one
+// tried in turn
+static int
+worker_spawn(pid_t *pid, posix_spawn_file_actions_t *actions, char **argv, int direct, char **env)
+{
+    static int next;
+    char index[16], *wargv[16];
+    int n = 0, r;
+
+    snprintf(index, sizeof index, "%d", (int)((getpid() + next++) % nworkers));
+    wargv[n++] = (char *)"redo-worker";
+    wargv[n++] = (char *)"--job";
+    wargv[n++] = index;
+    if (direct)
+	wargv[n++] = (char *)"--direct";
+    while (*argv && n < 15)
+	wargv[n++] = *argv++;
+    wargv[n] = 0;
+    if ((r = posix_spawn(pid, "/proc/self/exe", actions, 0, wargv, env)))
+	r = posix_spawnp(pid, "redo-worker", actions, 0, wargv, env);
+    return r;
+}
+
+// the user at the other end of unix socket conn, -1 if unknown
+static uid_t
+peer_uid(int conn)
+{
+#ifdef SO_PEERCRED
+    struct { pid_t pid; uid_t uid; gid_t gid; } cred;   // struct ucred, _GNU_SOURCE only
+    socklen_t len = sizeof cred;
+
+    return getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ? (uid_t)-1 : cred.uid;
+#else
+    uid_t uid;
+    gid_t gid;
+
+    return getpeereid(conn, &uid, &gid) < 0 ? (uid_t)-1 : uid;
+#endif
+}
+
+// redo-worker SOCKET: run the jobs sent to SOCKET, until killed
+static void
+worker_serve(const char *sock)
+{
+    struct sockaddr_un addr;
+    mode_t mask;
+    int fd, conn;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(sock) >= sizeof addr.sun_path)
+	die2("redo-worker: socket path too long", sock, 111);
+    strcpy(addr.sun_path, sock);
+    unlink(sock);
+    // jobs run as us: only for us to connect to, from the start
+    mask = umask(077);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+	bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+	chmod(sock, 0600) < 0 || listen(fd, 64) < 0)
+	die2("redo-worker: cannot listen on", sock, 111);
+    umask(mask);
+    signal(SIGCHLD, SIG_IGN);   // no zombies
+    signal(SIGPIPE, SIG_IGN);   // a client went away
+    for (;;) {
+	if ((conn = accept(fd, 0, 0)) < 0) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    die("redo-worker: accept", 111);
+	}
+	if (peer_uid(conn) != geteuid()) {
+	    err2("redo-worker: job of another user refused on", sock);
+	    close(conn);
+	    continue;
+	}
+	if (fork() == 0) {
+	    close(fd);
+	    signal(SIGCHLD, SIG_DFL);
+	    worker_run(conn, sock);
+	}
+	close(conn);
+    }
+}
+
+// job launcher
+
+/*
+  The cost of fork() grows with the memory of the redo process, so
+  .do files are started with posix_spawn(), which uses vfork() or
+  clone(CLONE_VFORK) where it can: what the child did before exec is
+  prepared by the parent, the environment as an array and the file
+  descriptors as file actions.  Whether a .do file is run by /bin/sh
+  comes from the stat() which found it.  A lock wait is spawned the
+  same way, as `redo --lock-wait` with the lock file on its stdin: it
+  only takes the lock and exits.
+*/
+
+// environ with the variables of set ("NAME=value", or "NAME" to
+// remove it) replaced, valid until the next call of the thread
+static char **
+spawn_env(char **set, int n)
+{
+    static _Thread_local char **env;
+    static _Thread_local size_t aenv;
+    size_t i, m = 0, len;
+    int k;
+
+    for (i = 0; environ[i]; i++)
+	;
+    if (i + n + 1 > aenv &&
+	!(env = realloc(env, (aenv = i + n + 1) * sizeof *env)))
+	die("out of memory", 100);
+    for (i = 0; environ[i]; i++) {
+	for (k = 0; k < n; k++) {
+	    len = strcspn(set[k], "=");
+	    if (!strncmp(environ[i], set[k], len) && environ[i][len] == '=')
 		break;
-	    default:  // dep file broken, lets recreate it
-		ok = 0;
-		dprint2("Rebuild, invalid dep file line: ", target);
+	}
+	if (k == n)
+	    env[m++] = environ[i];
+    }
+    for (k = 0; k < n; k++)
+	if (strchr(set[k], '='))
+	    env[m++] = set[k];
+    env[m] = 0;
+    return env;
+}
+
+// redo --lock-wait: wait until the lock on stdin is free
+static void
+lock_wait()
+{
+    if (lockf(0, F_LOCK, 0) == -1) {
+	perror("redo --lock-wait: lockf");
+	exit(100);
+    }
+    exit(0);
+}
+
+// start a lock wait for lock_fd, an errno value on failure
+static int
+lock_spawn(pid_t *pid, int lock_fd)
+{
+    char *argv[] = { (char *)"redo", (char *)"--lock-wait", 0 };
+    posix_spawn_file_actions_t actions;
+    int r;
+
+    if ((r = posix_spawn_file_actions_init(&actions)))
+	return r;
+    if (!(r = posix_spawn_file_actions_adddup2(&actions, lock_fd, 0)))
+	r = posix_spawn(pid, "/proc/self/exe", &actions, 0, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    return r;
+}
+
+pid_t
+new_waitjob(int lock_fd, int implicit)
+{
+	pid_t pid;
+	int64_t t0 = monotonic_ns();
+	struct job *job = malloc(sizeof *job);
+
+	if (!job)
+	    exit(-1);
+	job->lock_fd = lock_fd;
+	job->trace_fd = -1;
+	count(M_FORKS, 1);
+	count(M_LOCK_WAITS, 1);
+	if (lock_spawn(&pid, lock_fd) != 0)   // no /proc, fork the wait
+	    pid = fork();
+	if (pid == 0) { // child
+	    if (lockf(lock_fd, F_LOCK, 0)==-1) {
+		perror("new_waitjob: lockf");
+		exit(100);
+	    }
+	    close(lock_fd);
+	    exit(0);
+	}
+	count(M_SPAWN_NS, monotonic_ns() - t0);
+	if (pid < 0) {
+		perror("fork");
+		vacate(implicit);
+		exit(-1);
+	}
+	job->target = 0;
+	job->deprec = 0;
+	job->out_fd = job->dep_fd = -1;
+	job->pid = pid;
+	job->implicit = implicit;
+	job->pools = 0;
+	clock_gettime(CLOCK_MONOTONIC, &job->start);
+	
+	insert_job(job);
+
+	return pid;
+}
+
+/*
+  The targets are checked before any is started, and another process
+  of the build may build one of them meanwhile: it then holds the
+  lock, and we wait for it, or it has already removed the lock, and
+  we would build the target once more.  job_commit() renames a new
+  dep file into place, so another dep file than the one check_target()
+  read means the latter.
+*/
+static int
+built_since_check(char *target, char *path)
+{
+    struct memo *m;
+    struct stat st;
+    char *name;
+    int dir;
+
+    if ((dir = checkdir_lookup(0, path, &name)) < 0)
+	return 0;
+    m = memo_get(dir, 'f', name);
+    if (m->dep_ino == (ino_t)-1 || stat(targetdep(target), &st) < 0)
+	return 0;
+    return st.st_ino != m->dep_ino;
+}
+
+static void
+run_script(char *target, int implicit, unsigned pools)
+{
+    char temp_depfile[PATH_MAX];
+    char temp_target[PATH_MAX-1]; // Just outwitting the compile string length check :-0
+    char cwd[PATH_MAX], rel_target[PATH_MAX], rel_temp_target[PATH_MAX];
+    char *orig_target = target;
+    int old_dep_fd = dep_fd;
+    int target_fd, anon_out, anon_dep;
+    char deprec[DEP_RECORD];
+    struct timespec dep_time;
+    char *dofile, *dirprefix;
+    pid_t pid, my_pid=getpid();
+    struct stat st;
+    mode_t target_mode;
+
+    target = targetchdir(target);
+    
+    dofile = find_dofile(AT_FDCWD, target);
+    if (!dofile) {
+	fprintf(stderr, "no dofile for %s.\n", target);
+	exit(1);
+    }
+    int direct = (dofile_mode & 0111) != 0;
+
+    if (vflag)
+	fprintf(stderr, "redo %s\n", target);
+    
+    // Testing: deadlock checking:
+    //  On first instance we set an environment variable REDO_/HASH_OF_TARGET_ABSOLUTE_PATH/=PID
+    //  This can only be seen by a child process and if we see it, we break the cycle.
+    if (getcwd(cwd, sizeof cwd) == NULL) die2("getcwd", cwd, 100);
+    strncat(cwd, target, PATH_MAX-strlen(target));
+    char target_hash[PATH_MAX];
+    snprintf(target_hash, sizeof target_hash, "REDO_%s",
+	     hashtohex(siphash2_4_128(cwd, strlen(cwd), redo_siphash_key)));
+    char * target_hash_env = getenv(target_hash);
+    if (target_hash_env) {
+	fprintf(stderr, "error: cyclic dependency %s [%s]\n", orig_target, target_hash_env);
+	exit(-1);
+    }
+    // allow parallel building
+    check_or_create_dir(redo_base(target));
+    int lock_fd = open(targetlock(target), O_WRONLY | O_TRUNC | O_CREAT, 0666);
+    if (lock_fd<0) die2("failed to create: ", targetlock(target), 111);
+    jitter();
+    if (lockf(lock_fd, F_TLOCK, 0) < 0) {
+	if (errno == EAGAIN) {
+	    pool_give(pools);   // not needed for waiting
+	    pid = new_waitjob(lock_fd, implicit);
+	    if (dflag) {
+		fprintf(stderr, "%*.*s wait job %s [%d]\n",
+			level, level, " ", orig_target, pid);
 	    }
+	    return;
 	} else {
-	    if (!feof(f)) {
-		ok = 0;
-		dprint2("Rebuild, error while reading dep file: ", target);
-		break;
-	    }
+	    perror("run_script: lockf");
+	    exit(111);
+	}
+    }
+    if (built_since_check(target, orig_target)) {
+	pool_give(pools);
+	vacate(implicit);
+	close(lock_fd);
+	if (dflag)
+	    fprintf(stderr, "%*.*s built meanwhile %s\n", level, level, " ", orig_target);
+	return;
+    }
+    
+    strncpy(temp_depfile, targettmp(".dep", my_pid, target), sizeof temp_depfile);
+    // dep_fd is global
+    dep_fd = tmpfile_out ? open_tmpfile(redo_base(target), 0, 0600) : -1;
+    anon_dep = dep_fd >= 0;
+    if (dep_fd==-1)
+	dep_fd = open(temp_depfile, O_CREAT|O_WRONLY|O_EXCL, 0600);
+    if (dep_fd==-1)
+	die2("could not create temp_depfile: %s", temp_depfile, 100);
+    // every record is taken after the dep file was created
+    if (fstat(dep_fd, &st) < 0)
+	die2("could not stat temp_depfile: %s", temp_depfile, 100);
+    dep_time = st.st_mtim;
+
+    // write dependencies: the .do file is recorded as it is now, but
+    // written together with the target on completion
+    if (!dep_record(deprec, sizeof deprec, '=', "", dofile))
+	*deprec = 0;
+
+    // prepare the $3 file
+    strncpy(temp_target, targetout(my_pid, target), sizeof temp_target);
+    if (stat(target, &st)==-1)
+	target_mode = 0644;
+    else
+	target_mode = st.st_mode;
+    // a $3 which cannot be renamed or unlinked only when asked for
+    target_fd = tmpfile_out > 1 ? open_tmpfile(".", O_CLOEXEC, target_mode) : -1;
+    anon_out = target_fd >= 0;
+    if (anon_out) {
+	// the .do file sees it through our file descriptor
+	snprintf(temp_target, sizeof temp_target, "/proc/%d/fd/%d", my_pid, target_fd);
+    } else {
+	target_fd = open(temp_target, O_CREAT|O_RDWR|O_EXCL, target_mode);
+    }
+    if (target_fd==-1)
+	die2("could not create temp_targetfile: %s", temp_target, 100);
+    
+    // .do files are called from the directory they reside in, we need to
+    // prefix the arguments with the path from the dofile to the target
+    if (getcwd(cwd, sizeof cwd) == NULL) die2("getcwd", cwd, 100);
+    dirprefix = strchr(cwd, '\0');
+    dofile += 2;  // find_dofile starts with ./ always
+    while (strncmp(dofile, "../", 3) == 0) {
+	changedir(-1, "..");
+	dofile += 3;
+	while (*--dirprefix != '/')
+	    ;
+    }
+    if (*dirprefix)
+	dirprefix++;
+
+    if (setenv("REDO_DIRPREFIX", dirprefix, 1)) die2("setenv REDO_DIRPREFIX", dirprefix, 100);
+
+    snprintf(rel_target, sizeof rel_target,
+	     "%s%s%s", dirprefix, (*dirprefix ? "/" : ""), target);
+    
+    if (*temp_target == '/')
+	snprintf(rel_temp_target, sizeof rel_temp_target, "%s", temp_target);
+    else
+	snprintf(rel_temp_target, sizeof rel_temp_target,
+		 "%s%s%s", dirprefix, (*dirprefix ? "/" : ""), temp_target);
+
+    /*
+      djb-style default.o.do:
+      $1	   foo.o
+      $2	   foo
+      $3	   whatever.tmp
+
+      $1	   all
+      $2	   all (!!)
+      $3	   whatever.tmp
+
+      $1	   subdir/foo.o
+      $2	   subdir/foo
+      $3	   subdir/whatever.tmp
+    */
+    char *argv[] = { (char *)"/bin/sh", (char *)(xflag > 0 ? "-ex" : "-e"), dofile,
+		     rel_target, redo_basename(dofile, rel_target), rel_temp_target, 0 };
+    char env_dep[32], env_level[32], env_hash[PATH_MAX+32], env_slot[32], env_trace[32];
+    char *env[] = { env_dep, env_level, env_hash, env_slot, env_trace, deptrace_preload };
+    int nenv = deptrace && !nworkers ? 6 : 4;
+    posix_spawn_file_actions_t actions;
+    int slot = slot_alloc(pools), r = ENOEXEC;
+    int trace_fd = deptrace && !nworkers ? deptrace_open(target) : -1;
+    int64_t t0 = monotonic_ns();
+
+    snprintf(env_dep, sizeof env_dep, "REDO_DEP_FD=%d", dep_fd);
+    snprintf(env_level, sizeof env_level, "REDO_LEVEL=%d", level + 1);
+    // Testing: deadlock checking
+    snprintf(env_hash, sizeof env_hash, "%s=%d", target_hash, my_pid);
+    if (slot >= 0)
+	snprintf(env_slot, sizeof env_slot, "REDO_SLOT=%d", slot);
+    else
+	snprintf(env_slot, sizeof env_slot, "REDO_SLOT");
+    snprintf(env_trace, sizeof env_trace, "REDO_DEPTRACE_FD=%d", trace_fd);
+    posix_spawn_file_actions_init(&actions);
+    if (old_dep_fd > 0) {
+	// Testing
+	if (dflag)
+	    fprintf(stderr, "warning run_script: global dep_fd > 0: %d\n", old_dep_fd);
+	posix_spawn_file_actions_addclose(&actions, old_dep_fd);
+    }
+    posix_spawn_file_actions_addclose(&actions, lock_fd);
+    posix_spawn_file_actions_adddup2(&actions, target_fd, 1);
+    count(M_FORKS, 1);
+    count(M_REBUILT, 1);
+    if (nworkers) {   // the client of a worker, see worker_client()
+	r = worker_spawn(&pid, &actions, direct ? argv + 2 : argv, direct, spawn_env(env, nenv));
+    } else {
+	if (direct)   // run -x files with /bin/sh, and those the kernel cannot run
+	    r = posix_spawn(&pid, dofile, &actions, 0, argv + 2, spawn_env(env, nenv));
+	if (r == ENOEXEC || r == EACCES)
+	    r = posix_spawn(&pid, "/bin/sh", &actions, 0, argv, spawn_env(env, nenv));
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    count(M_SPAWN_NS, monotonic_ns() - t0);
+    slot_start(slot, r ? -1 : pid);
+
+    if (r) {
+	fprintf(stderr, "redo: cannot run %s: %s\n", dofile, strerror(r));
+	count(M_FAILED, 1);
+	targetchdir(orig_target);
+	if (!anon_out)
+	    remove_temp(temp_target);
+	if (!anon_dep)
+	    remove_temp(temp_depfile);
+	close(target_fd);
+	close(dep_fd);
+	if (trace_fd >= 0)
+	    close(trace_fd);
+	dep_fd = old_dep_fd;
+	close(lock_fd);
+	pool_give(pools);
+	vacate(implicit);
+	if (kflag < 0)
+	    exit(111);
+    } else {
+	struct job *job = malloc(sizeof *job);
+	if (!job)
+	    exit(-1);
+	
+	job->out_fd = anon_out ? target_fd : (close(target_fd), -1);
+	job->dep_fd = anon_dep ? dep_fd : (close(dep_fd), -1);
+	dep_fd = old_dep_fd;
+
+	job->pid = pid;
+	job->lock_fd = lock_fd;
+	job->target = orig_target;
+	job->temp_depfile = strdup(temp_depfile);
+	job->temp_target = strdup(anon_out ? targetout(my_pid, target) : temp_target);
+	job->deprec = strdup(deprec);
+	job->implicit = implicit;
+	job->pools = pools;
+	job->trace_fd = trace_fd;
+	job->dep_time = dep_time;
+	clock_gettime(CLOCK_MONOTONIC, &job->start);
+
+	insert_job(job);
+	
+	if (dflag)
+	    fprintf(stderr, "%*.*sredo %s # %s [%d]\n",
+		    level, level, " ", orig_target, dofile, pid);
+    }
+}
+
+// resource usage
+
+/*
+  The usage of each job comes from wait4().  It includes the jobs the
+  .do file waited for through redo-ifchange, which add their usage to
+  the slot of the .do file, and CPU time and block I/O of those are
+  subtracted again.  Max RSS and wall time cannot be separated.  The
+  result is written to <target>.rusage in the database directory and
+  summarized by redo --stats.
+*/
+
+static void
+job_usage(struct job *job, struct rusage *ru, struct usage *u)
+{
+    struct usage deps = { 0, 0, 0, 0, 0, 0 };
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    u->user = ru->ru_utime.tv_sec * 1000000LL + ru->ru_utime.tv_usec;
+    u->sys = ru->ru_stime.tv_sec * 1000000LL + ru->ru_stime.tv_usec;
+    u->inblock = ru->ru_inblock;
+    u->oublock = ru->ru_oublock;
+    u->maxrss = ru->ru_maxrss;
+    u->wall = (now.tv_sec - job->start.tv_sec) * 1000000LL +
+	(now.tv_nsec - job->start.tv_nsec) / 1000;
+
+    // the .do file calling us gets it all
+    if (shared && my_slot >= 0) {
+	struct usage *d = &shared->slot[my_slot].deps;
+	__sync_fetch_and_add(&d->user, u->user);
+	__sync_fetch_and_add(&d->sys, u->sys);
+	__sync_fetch_and_add(&d->inblock, u->inblock);
+	__sync_fetch_and_add(&d->oublock, u->oublock);
+    }
+    slot_free(job->pid, &deps, &job->pools);
+    u->user = u->user > deps.user ? u->user - deps.user : 0;
+    u->sys = u->sys > deps.sys ? u->sys - deps.sys : 0;
+    u->inblock = u->inblock > deps.inblock ? u->inblock - deps.inblock : 0;
+    u->oublock = u->oublock > deps.oublock ? u->oublock - deps.oublock : 0;
+}
+
+static void
+write_usage(char *target, struct usage *u, int status)
+{
+    int fd = open(targetusage(target), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+	return;
+    dprintf(fd, "user=%" PRId64 " sys=%" PRId64 " maxrss=%" PRId64
+	    " inblock=%" PRId64 " oublock=%" PRId64 " wall=%" PRId64 " status=%d\n",
+	    u->user, u->sys, u->maxrss, u->inblock, u->oublock, u->wall, status);
+    close(fd);
+}
+
+// durability
+
+/*
+  REDO_DURABILITY sets what must be on disk before a job counts as
+  done.  With none, the default, outputs and dep files are renamed
+  into place and written back whenever the kernel likes: after a
+  crash, a dep file may claim an output whose data was lost, and the
+  target is not rebuilt.  With strict, every job syncs its output
+  before renaming it, then its dep file, and the directories of both.
+  With batch, jobs sync nothing.  The top-level redo leaves a marker
+  with its start time in the database directory, syncs the file
+  systems at its end and removes the marker.  A later build which
+  finds the marker of a build that died marks the dep files written
+  since then with '!', so only the targets of that build are rebuilt.
+  Only dep files below the directory of the top-level redo are found.
+*/
+
+enum { DURABLE_NONE, DURABLE_BATCH, DURABLE_STRICT };
+static int durability = DURABLE_NONE;
+static char build_marker[2*PATH_MAX+32];   // ours, relative to dir_fd
+
+// pick up REDO_DURABILITY: none (default), batch or strict
+static void
+setup_durability()
+{
+    char *s = getenv("REDO_DURABILITY");
+
+    if (!s || !*s || !strcmp(s, "none"))
+	durability = DURABLE_NONE;
+    else if (!strcmp(s, "batch"))
+	durability = DURABLE_BATCH;
+    else if (!strcmp(s, "strict"))
+	durability = DURABLE_STRICT;
+    else
+	die2("invalid REDO_DURABILITY, use none, batch or strict", s, 111);
+}
+
+// the data of file path, or the entries of directory path, on disk
+static void
+sync_path(const char *path, int dir)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC | (dir ? O_DIRECTORY : 0));
+
+    if (fd < 0 || (dir ? fsync(fd) : fdatasync(fd)) < 0)
+	err2("cannot sync", path);
+    if (fd >= 0)
+	close(fd);
+}
+
+// batch: everything the build wrote on disk, one call per file system
+static void
+sync_build()
+{
+#ifdef SYS_syncfs
+    int fd;
+
+    if (shared && !shared->sync_all) {
+	if (syscall(SYS_syncfs, dir_fd) < 0)
+	    perror("syncfs");
+	if (db_dir && (fd = open(*db_dir ? db_dir : "/", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+	    if (syscall(SYS_syncfs, fd) < 0)
+		perror("syncfs");
+	    close(fd);
 	}
+	return;
+    }
+#endif
+    sync();
+}
+
+// the earliest start of the builds in database directory base which
+// died, 0 if none.  With remove set, their markers are removed instead.
+static time_t
+build_markers(const char *base, int remove)
+{
+    char path[2*PATH_MAX+64];
+    struct dirent *de;
+    long long t;
+    time_t since = 0;
+    pid_t pid;
+    FILE *f;
+    DIR *d;
+
+    snprintf(path, sizeof path, "%s/.build", base);
+    if (!(d = opendir(path)))
+	return 0;
+    while ((de = readdir(d))) {
+	if ((pid = atoi(de->d_name)) <= 0)
+	    continue;
+	// a marker of our pid is from a dead build until we write ours
+	if (pid == getpid() ? remove : kill(pid, 0) == 0 || errno != ESRCH)
+	    continue;
+	snprintf(path, sizeof path, "%s/.build/%s", base, de->d_name);
+	if (remove) {
+	    unlink(path);
+	} else if ((f = fopen(path, "r"))) {
+	    // empty if it died before starting any job
+	    if (fscanf(f, "%lld", &t) == 1 && (!since || t < since))
+		since = t;
+	    fclose(f);
+	}
+    }
+    closedir(d);
+    return since;
+}
+
+struct recovery {
+    time_t since, until;   // of the builds which died
+    int n;
+};
+
+static void db_walk(const char *suffix,
+		    void (*fn)(const char *target, const char *file, void *arg), void *arg);
+
+// rebuild target if a build which died wrote its dep file
+static void
+recover_dep(const char *target, const char *file, void *arg)
+{
+    struct recovery *r = arg;
+    struct stat st;
+    char buf[PATH_MAX+8], *nl;
+    ssize_t n;
+    int fd;
+
+    if (stat(file, &st) < 0 || st.st_mtime < r->since || st.st_mtime >= r->until)
+	return;
+    if ((fd = open(file, O_RDWR | O_CLOEXEC)) < 0) {
+	err2("cannot reset dep file", file);
+	return;
+    }
+    n = read(fd, buf, PATH_MAX+2);
+    buf[n > 0 ? n : 0] = 0;
+    // an output keeps the target producing it
+    n = *buf == '@' && (nl = strchr(buf, '\n')) ? nl + 1 - buf : 0;
+    n += snprintf(buf + n, sizeof buf - n, "!\n");
+    if (ftruncate(fd, 0) < 0 || pwrite(fd, buf, n, 0) != n)
+	err2("cannot reset dep file", file);
+    close(fd);
+    dprint2("Rebuild, dep file written by a build which died: ", target);
+    r->n++;
+}
+
+static void
+durability_exit()
+{
+    changedir(dir_fd, 0);
+    sync_build();
+    unlink(build_marker);
+}
+
+// the top-level redo recovers from builds which died, and in batch
+// mode leaves its marker before any job runs
+static void
+durability_start()
+{
+    struct recovery r = { 0, 0, 0 };
+    char base[2*PATH_MAX], dir[2*PATH_MAX+8];
+    struct stat st;
+    int fd;
+
+    if (!shared_owner)
+	return;
+    changedir(dir_fd, 0);
+    snprintf(base, sizeof base, "%s", redo_base_dir("."));
+    // the file system clock may lag a tick behind time()
+    r.until = time(0) - 1;
+    r.since = build_markers(base, 0);
+
+    if (durability == DURABLE_BATCH) {
+	if (shared && fstat(dir_fd, &st) == 0)
+	    shared->sync_dev = st.st_dev;
+	check_or_create_dir(base);
+	snprintf(dir, sizeof dir, "%s/.build", base);
+	check_or_create_dir(dir);
+	snprintf(build_marker, sizeof build_marker, "%s/%d", dir, (int)getpid());
+	if ((fd = open(build_marker, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+	    die2("cannot create", build_marker, 111);
+	// a recovery we do not finish is done again
+	dprintf(fd, "%lld\n", (long long)(r.since ? r.since : r.until));
+	if (fsync(fd) < 0)
+	    err2("cannot sync", build_marker);
+	close(fd);
+	sync_path(dir, 1);
+	sync_path(base, 1);
+	atexit(durability_exit);
+    }
+
+    if (!r.since)
+	return;
+    db_walk(".dep", recover_dep, &r);
+    changedir(dir_fd, 0);
+    if (r.n)
+	fprintf(stderr, "redo: rebuilding the %d targets of a build which died\n", r.n);
+    sync_build();
+    build_markers(base, 1);
+}
+
+// multiple outputs
+
+/*
+  A .do file may produce more files than its target: it writes them
+  itself and declares them with redo-output, which adds '+' lines with
+  their paths to the dep file.  When the target was built, each output
+  gets a dep file of its own, with an '@' line naming the target and
+  the record of the output, and the declarations become '+' records
+  with hash and time stamp.  An output is up to date when its target
+  is, and is built by building its target, under the target's lock.
+  The target is rebuilt when one of its outputs changed.
+*/
+
+
+// give output path of target, both relative to the current directory,
+// a dep file pointing to target
+static void
+commit_output(char *target, char *path)
+{
+    char dir[PATH_MAX], primary[2*PATH_MAX], cwd[PATH_MAX], *s;
+    char depfile[2*PATH_MAX+8], temp[2*PATH_MAX+32], buf[3*PATH_MAX+DEP_RECORD];
+    const char *slash = strrchr(path, '/'), *name = slash ? slash + 1 : path;
+    const char *base;
+    int fd, n, r, up = 0;
+
+    snprintf(dir, sizeof dir, "%.*s", slash ? (int)(slash - path) : 0, path);
+    // target relative to the directory of path
+    snprintf(temp, sizeof temp, "/%s/", dir);
+    if (*path == '/' || strstr(temp, "/../")) {
+	if (!getcwd(cwd, sizeof cwd))
+	    die("getcwd", 100);
+	snprintf(primary, sizeof primary, "%s/%s", cwd, target);
+    } else {
+	for (s = dir; *dir && s; s = strchr(s + 1, '/'))
+	    up++;
+	for (*primary = 0; up > 0; up--)
+	    strcat(primary, "../");
+	strncat(primary, target, sizeof primary - strlen(primary) - 1);
+    }
+
+    // the record of the output names it relative to its directory
+    n = snprintf(buf, sizeof buf, "@%s\n", primary);
+    if (!(r = dep_record(buf + n, sizeof buf - n, '=', "", path))) {
+	err2("redo-output: not created", path);
+	return;
     }
+    snprintf(buf + n + 1 + HASH_CHARS + 1 + 16 + 1,
+	     sizeof buf - (n + 1 + HASH_CHARS + 1 + 16 + 1), "%s\n", name);
+    n = strlen(buf);
+    if (durability == DURABLE_STRICT) {
+	sync_path(path, 0);
+	sync_path(*dir ? dir : ".", 1);
+    }
+
+    base = redo_base(path);
+    check_or_create_dir(base);
+    snprintf(depfile, sizeof depfile, "%s/%s.dep", base, name);
+    snprintf(temp, sizeof temp, "%s/.dep.%d.%s", base, (int)getpid(), name);
+    if ((fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+	err2("redo-output: cannot create", temp);
+	return;
+    }
+    write(fd, buf, n);
+    if (durability == DURABLE_STRICT && fdatasync(fd) < 0)
+	err2("cannot sync", temp);
+    close(fd);
+    rename_temp(temp, depfile);
+    if (durability == DURABLE_STRICT)
+	sync_path(base, 1);
+}
+
+// order of dependency records
+
+/*
+  check_target() stops at the first record which does not match, so
+  a target which needs a rebuild is found sooner when the records of
+  files which are likely to change come first.  When a dep file is
+  written, the cheap records ('!', '-', '%') come first, then those
+  of files which changed since the last build of the target, or are
+  new to it, then the others in their order in the old dep file; the
+  record of the target itself comes last.  The old order is the
+  statistic: files which change often stay in front, those which
+  never do sink to the back.
+*/
+
+struct dep_line {
+    char *line;   // without its newline
+    int rank;     // -1 cheap, 0 changed, else 1 + index in old dep file
+    int index;    // in the new dep file
+};
+
+// the file named by record line, 0 for records without hash
+static const char *
+dep_line_path(const char *line)
+{
+    if ((*line != '=' && *line != '+' && *line != '*') ||
+	strlen(line) < 1 + HASH_CHARS + 1 + 16 + 1)
+	return 0;
+    return line + 1 + HASH_CHARS + 1 + 16 + 1;
+}
+
+static int
+dep_line_cmp(const void *a, const void *b)
+{
+    const struct dep_line *x = a, *y = b;
+    int r = strcmp(dep_line_path(x->line), dep_line_path(y->line));
+    return r ? r : x->line[0] - y->line[0];
+}
+
+static int
+dep_rank_cmp(const void *a, const void *b)
+{
+    const struct dep_line *x = a, *y = b;
+    if (x->rank != y->rank)
+	return x->rank < y->rank ? -1 : 1;
+    return x->index - y->index;
+}
 
-    fclose(f);
+// split buf at newlines into *v, n lines; 0 if out of memory
+static struct dep_line *
+dep_lines(char *buf, int *n)
+{
+    struct dep_line *v;
+    char *line, *next;
+    int a = 64;
 
-    close(dir_fd);
-    dir_fd = old_dir_fd;
-    if (ok)
-	dprint2("Not rebuilt, already up-to-date: ", target);
-    return ok;
+    *n = 0;
+    if (!(v = malloc(a * sizeof *v)))
+	return 0;
+    for (line = buf; *line; line = next) {
+	if ((next = strchr(line, '\n')))
+	    *next++ = 0;
+	else
+	    next = strchr(line, 0);
+	if (*n == a && !(v = realloc(v, (a *= 2) * sizeof *v)))
+	    return 0;
+	v[*n].line = line;
+	v[*n].rank = *n + 1;
+	v[*n].index = *n;
+	(*n)++;
+    }
+    return v;
 }
 
-char uprel[PATH_MAX];
+// the records in buf, len bytes, of target, ordered against those in
+// its old dep file, into out
+static size_t
+dep_order(char *buf, size_t len, char *target, char *out)
+{
+    struct dep_line *v = 0, *old = 0, *o, key;
+    char *prev = 0;
+    const char *path;
+    size_t n = 0;
+    int nv = 0, nold = 0, i, fd;
+
+    buf[len] = 0;
+    if ((fd = open(targetdep(target), O_RDONLY | O_CLOEXEC)) >= 0) {
+	prev = deptrace_read(fd);
+	close(fd);
+    }
+    if (!(v = dep_lines(buf, &nv)) || (prev && !(old = dep_lines(prev, &nold)))) {
+	free(v);
+	free(prev);
+	memcpy(out, buf, len);
+	return len;
+    }
+    // only the records with a hash are looked up
+    for (i = 0, o = old; i < nold; i++)
+	if (dep_line_path(old[i].line))
+	    *o++ = old[i];
+    nold = o - old;
+    qsort(old, nold, sizeof *old, dep_line_cmp);
+
+    for (i = 0; i < nv; i++) {
+	if (!(path = dep_line_path(v[i].line))) {
+	    v[i].rank = -1;
+	    continue;
+	}
+	if (*v[i].line == '=' && !strcmp(path, target)) {
+	    v[i].rank = INT_MAX;
+	    continue;
+	}
+	key.line = v[i].line;
+	o = nold ? bsearch(&key, old, nold, sizeof *old, dep_line_cmp) : 0;
+	// same hash and time stamp
+	v[i].rank = o && !strncmp(o->line, v[i].line, 1 + HASH_CHARS + 1 + 16) ? o->rank : 0;
+    }
+    qsort(v, nv, sizeof *v, dep_rank_cmp);
+    for (i = 0; i < nv; i++)
+	n += sprintf(out + n, "%s\n", v[i].line);
+
+    free(v);
+    free(old);
+    free(prev);
+    return n;
+}
 
-void
-compute_uprel()
+// write the records in deps to the dep file dfd of target, after
+// committing the outputs declared with redo-output, see dep_order()
+static void
+commit_deps(int dfd, char *target, char *deps, int len)
 {
-    char *u = uprel;
-    char *dp = getenv("REDO_DIRPREFIX");
+    char *buf, *out, *line, *next, *sorted, rec[DEP_RECORD];
+    size_t n = 0, size;
 
-    *u = 0;
-    while (dp && *dp) {
-	*u++ = '.';
-	*u++ = '.';
-	*u++ = '/';
-	*u = 0;
-	dp = strchr(dp + 1, '/');
+    if (!(buf = deptrace_read(dfd))) {
+	lseek(dfd, 0, SEEK_END);
+	write(dfd, deps, len);
+	return;
+    }
+
+    size = strlen(buf) + len + DEP_RECORD;
+    if (!(out = malloc(size)))
+	die("out of memory", 100);
+    for (line = buf; *line; line = next) {
+	int rn = 0;
+	if ((next = strchr(line, '\n')))
+	    *next++ = 0;
+	else
+	    next = strchr(line, 0);
+	if (*line == '+') {
+	    if (strcmp(line + 1, target)) {
+		commit_output(target, line + 1);
+		rn = dep_record(rec, sizeof rec, '+', "", line + 1);
+	    }
+	} else {
+	    rn = snprintf(rec, sizeof rec, "%s\n", line);
+	}
+	if (n + rn + len >= size && !(out = realloc(out, size = 2*size + rn)))
+	    die("out of memory", 100);
+	memcpy(out + n, rec, rn);
+	n += rn;
     }
+    memcpy(out + n, deps, len);
+    n += len;
+    if (!(sorted = malloc(n + 1)))
+	die("out of memory", 100);
+    n = dep_order(out, n, target, sorted);
+    if (ftruncate(dfd, 0) < 0 || pwrite(dfd, sorted, n, 0) != (ssize_t)n)
+	err2("cannot write dep file of", target);
+    free(sorted);
+    free(out);
+    free(buf);
 }
 
-static int
-write_dep(int dep_fd, char *file)
+// the target whose .do file produces output target, or 0
+static char *
+output_primary(char *target)
 {
-    int fd = open(file, O_RDONLY);
-    if (fd < 0)
+    const char *slash = strrchr(target, '/');
+    char buf[PATH_MAX+2], dir[PATH_MAX], path[2*PATH_MAX], *nl;
+    ssize_t r;
+    int fd;
+
+    changedir(dir_fd, 0);
+    snprintf(dir, sizeof dir, "%.*s", slash ? (int)(slash - target) : 0, target);
+    snprintf(path, sizeof path, "%s/%s.dep", redo_base(target), slash ? slash + 1 : target);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
 	return 0;
-    dprintf(dep_fd, "=%s %s %s%s\n",
-	    hashtohex(hashfile(fd)), datefile(fd), (*file == '/' ? "" : uprel), file);
+    r = read(fd, buf, sizeof buf - 1);
     close(fd);
-    return 0;
+    if (r <= 1 || *buf != '@')
+	return 0;
+    buf[r] = 0;
+    if ((nl = strchr(buf, '\n')))
+	*nl = 0;
+    db_path(dir, buf + 1, path, sizeof path);
+    return strdup(path);
 }
 
-// dofile doesn't contain /
-// target can contain /
-static char *
-redo_basename(char *dofile, char *target)
+// whether target has a .do file, relative to the current directory
+static int
+has_dofile(char *target)
 {
-    static char buf[PATH_MAX];
-    int stripext = 0;
-    char *s;
+    char *slash = strrchr(target, '/');
+    int fd = dir_fd, found;
 
-    if (strncmp(dofile, "default.", 8) == 0)
-	for (stripext = -1, s = dofile; *s; s++)
-	    if (*s == '.')
-		stripext++;
+    if (slash) {
+	*slash = 0;
+	fd = openat(dir_fd, target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	*slash = '/';
+	if (fd < 0)
+	    return 0;
+    }
+    found = find_dofile(fd, slash ? slash + 1 : target) != 0;
+    if (slash)
+	close(fd);
+    return found;
+}
 
-    strncpy(buf, target, sizeof buf);
-    while (stripext-- > 0) {
-	if (strchr(buf, '.')) {
-	    char *e = strchr(buf, '\0');
-	    while (*--e != '.')
-		*e = 0;
-	    *e = 0;
+// job completion
+
+/*
+  A job which succeeded is committed: its output is renamed into
+  place and hashed for its dep file, which is written with those of
+  its outputs.  Hashing a large output takes a while, so on Linux a
+  thread with a working directory of its own does it, while the main
+  loop goes on.  The job token is given back at once.  The lock of
+  the target is only released once it is committed, so redo
+  processes waiting for the target see it done.  redo_ifchange()
+  returns when all its jobs are committed, and so does exit().
+*/
+
+// the job of target, with dep file dfd, called redo-always and its
+// output out is the same as the one recorded in depfile, which is
+// still in place: then it is kept, and so is its time stamp, on which
+// the targets depending on it rely
+static int
+always_unchanged(struct job *job, int dfd, char *depfile, char *target)
+{
+    char *deps, *old = 0, *line, *end, *rec = 0;
+    size_t len = strlen(target);
+    int fd, same = 0;
+
+    if (!(deps = deptrace_read(dfd)))
+	return 0;
+    if ((*deps == '!' || strstr(deps, "\n!")) && (fd = open(depfile, O_RDONLY | O_CLOEXEC)) >= 0) {
+	old = deptrace_read(fd);
+	close(fd);
+    }
+    free(deps);
+    // the record of the target itself
+    for (line = old; line && (end = strchr(line, '\n')); line = end + 1)
+	if (*line == '=' && (size_t)(end - line) == 1 + HASH_CHARS + 1 + 16 + 1 + len &&
+	    !strncmp(end - len, target, len)) {
+	    rec = line;
+	    break;
 	}
+    if (rec && (fd = open(target, O_RDONLY | O_CLOEXEC)) >= 0) {
+	same = !strncmp(rec + 1 + HASH_CHARS + 1, datefile(fd), 16);
+	close(fd);
     }
-
-    return buf;
+    if (same) {
+	fd = job->out_fd >= 0 ? job->out_fd : open(job->temp_target, O_RDONLY | O_CLOEXEC);
+	same = fd >= 0 && !strncmp(rec + 1, hashtohex(hashfile(fd)), HASH_CHARS);
+	if (fd >= 0 && fd != job->out_fd)
+	    close(fd);
+    }
+    free(old);
+    return same;
 }
 
-pid_t
-new_waitjob(int lock_fd, int implicit)
+// the job succeeded: its output and dep file take their place
+static void
+job_commit(struct job *job)
 {
-	pid_t pid;
-
-	pid = fork();
-	if (pid < 0) {
-		perror("fork");
-		vacate(implicit);
-		exit(-1);
+    struct stat st;
+    char *target = targetchdir(job->target);
+    char *depfile = targetdep(target);
+    char deps[2*DEP_RECORD];
+    int dfd, len = snprintf(deps, DEP_RECORD, "%s", job->deprec);
+
+    // Note: what if.. we can't open it?
+    dfd = job->dep_fd >= 0 ? job->dep_fd
+	: open(job->temp_depfile, O_RDWR);
+
+    if (job->out_fd >= 0 ? fstat(job->out_fd, &st) : stat(job->temp_target, &st)) {
+	// Ohh: can't access produced output!
+	perror(job->temp_target);
+	if (job->out_fd < 0)
+	    remove_temp(job->temp_target);
+	// ToDo: ahmmm, we leave old target alone and do as if it were not here?
+	len += snprintf(deps + len, DEP_RECORD, "-%s\n", target);
+    } else {
+	if (st.st_size && always_unchanged(job, dfd, depfile, target)) {
+	    dprint2("Output unchanged, kept: ", target);
+	    if (job->out_fd < 0)
+		remove_temp(job->temp_target);
+	    len += dep_record(deps + len, DEP_RECORD, '=', "", target);
 	}
-	if (pid == 0) { // child
-	    if (lockf(lock_fd, F_LOCK, 0)==-1) {
-		perror("new_waitjob: lockf");
-		exit(100);
+	else if (st.st_size) {
+	    if (durability == DURABLE_STRICT) {
+		if (job->out_fd < 0)
+		    sync_path(job->temp_target, 0);
+		else if (fdatasync(job->out_fd) < 0)
+		    err2("cannot sync", target);
+	    } else if (durability == DURABLE_BATCH && shared && st.st_dev != shared->sync_dev) {
+		shared->sync_all = 1;
 	    }
-	    close(lock_fd);
-	    exit(0);
+	    if (job->out_fd >= 0)
+		link_tmpfile(job->out_fd, job->temp_target, target);
+	    else
+		rename_temp(job->temp_target, target);
+	    if (durability == DURABLE_STRICT)
+		sync_path(".", 1);
+	    len += dep_record(deps + len, DEP_RECORD, '=', "", target);
 	}
-	struct job *job = malloc(sizeof *job);
-	if (!job)
-	    exit(-1);
-	job->target = 0;
-	job->pid = pid;
-	job->lock_fd = lock_fd;
-	job->implicit = implicit;
-	
-	insert_job(job);
-
-	return pid;
+	else {
+	    if (job->out_fd < 0)
+		remove_temp(job->temp_target);
+	    len += snprintf(deps + len, DEP_RECORD, "!\n");
+	}
+    }
+    if (job->trace_fd >= 0)
+	deptrace_commit(job->trace_fd, dfd, target, job->deprec);
+    // one write for all records of this process
+    commit_deps(dfd, target, deps, len);
+    // the dep file is dated when the job started, before its records
+    struct timespec times[2] = { { 0, UTIME_OMIT }, job->dep_time };
+    futimens(dfd, times);
+    if (durability == DURABLE_STRICT && fdatasync(dfd) < 0)
+	err2("cannot sync", depfile);
+    if (job->dep_fd >= 0)
+	link_tmpfile(dfd, job->temp_depfile, depfile);
+    else
+	rename_temp(job->temp_depfile, depfile);
+    close(dfd);
+    if (durability == DURABLE_STRICT)
+	sync_path(redo_base(target), 1);
+    // built: up to date for the rest of the build, see verified_put();
+    // its dependencies are not known here
+    if (verified_seq && stat(".", &st) == 0) {
+	uint64_t key[2];
+	verified_key(st.st_dev, st.st_ino, target, key);
+	verified_put(key, ~(uint64_t)0);
+    }
+    remove_temp(targetlock(target));
+    if (job->out_fd >= 0)
+	close(job->out_fd);
+    if (job->trace_fd >= 0)
+	close(job->trace_fd);
+    free(job->deprec);
+    close(job->lock_fd);
 }
 
-static void
-run_script(char *target, int implicit)
+static pthread_mutex_t commit_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+static struct job *commit_head, **commit_tail = &commit_head;
+static int commit_pending;   // jobs queued or being committed
+static int commit_thread;    // 1 running, -1 not available
+static pthread_t commit_tid;
+
+#ifdef HAVE_CLONE
+static void *
+commit_worker(void *arg)
 {
-    char temp_depfile[PATH_MAX];
-    char temp_target[PATH_MAX-1]; // Just outwitting the compile string length check :-0
-    char cwd[PATH_MAX], rel_target[PATH_MAX], rel_temp_target[PATH_MAX];
-    char *orig_target = target;
-    int old_dep_fd = dep_fd;
-    int target_fd;
-    char *dofile, *dirprefix;
-    pid_t pid, my_pid=getpid();
-    struct stat st;
-    mode_t target_mode;
+    struct job *job;
 
-    target = targetchdir(target);
-    
-    dofile = find_dofile(target);
-    if (!dofile) {
-	fprintf(stderr, "no dofile for %s.\n", target);
-	exit(1);
+    (void)arg;
+    pthread_mutex_lock(&commit_mutex);
+    commit_thread = syscall(SYS_unshare, CLONE_FS) == 0 ? 1 : -1;
+    pthread_cond_broadcast(&commit_cond);
+    while (commit_thread > 0) {
+	if (!(job = commit_head)) {
+	    pthread_cond_wait(&commit_cond, &commit_mutex);
+	    continue;
+	}
+	if (!(commit_head = job->next))
+	    commit_tail = &commit_head;
+	pthread_mutex_unlock(&commit_mutex);
+	job_commit(job);
+	pthread_mutex_lock(&commit_mutex);
+	commit_pending--;
+	pthread_cond_broadcast(&commit_cond);
     }
+    pthread_mutex_unlock(&commit_mutex);
+    return 0;
+}
+#endif
 
-    if (vflag)
-	fprintf(stderr, "redo %s\n", target);
-    
-    // Testing: deadlock checking:
-    //  On first instance we set an environment variable REDO_/HASH_OF_TARGET_ABSOLUTE_PATH/=PID
-    //  This can only be seen by a child process and if we see it, we break the cycle.
-    if (getcwd(cwd, sizeof cwd) == NULL) die2("getcwd", cwd, 100);
-    strncat(cwd, target, PATH_MAX-strlen(target));
-    char target_hash[PATH_MAX];
-    snprintf(target_hash, sizeof target_hash, "REDO_%s",
-	     hashtohex(siphash2_4_128(cwd, strlen(cwd), redo_siphash_key)));
-    char * target_hash_env = getenv(target_hash);
-    if (target_hash_env) {
-	fprintf(stderr, "error: cyclic dependency %s [%s]\n", orig_target, target_hash_env);
-	exit(-1);
+// wait until all jobs are committed, returns whether there were any
+static int
+commit_drain()
+{
+    int waited = 0;
+
+    if (commit_thread <= 0 || pthread_equal(pthread_self(), commit_tid))
+	return 0;   // none, or exit() while committing
+    pthread_mutex_lock(&commit_mutex);
+    while (commit_pending > 0) {
+	waited = 1;
+	pthread_cond_wait(&commit_cond, &commit_mutex);
     }
-    // allow parallel building
-    check_or_create_dir(redo_base(target));
-    int lock_fd = open(targetlock(target), O_WRONLY | O_TRUNC | O_CREAT, 0666);
-    if (lock_fd<0) die2("failed to create: ", targetlock(target), 111);
-    if (lockf(lock_fd, F_TLOCK, 0) < 0) {
-	if (errno == EAGAIN) {
-	    pid = new_waitjob(lock_fd, implicit);
-	    if (dflag) {
-		fprintf(stderr, "%*.*s wait job %s [%d]\n",
-			level, level, " ", orig_target, pid);
-	    }
-	    return;
+    pthread_mutex_unlock(&commit_mutex);
+    return waited;
+}
+
+static void
+commit_exit()
+{
+    commit_drain();
+}
+
+static void
+commit_start(struct job *job)
+{
+#ifdef HAVE_CLONE
+    sigset_t all, old;
+
+    pthread_mutex_lock(&commit_mutex);
+    if (!commit_thread) {
+	// signals are for the main loop
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	if (pthread_create(&commit_tid, 0, commit_worker, 0) == 0) {
+	    pthread_detach(commit_tid);
+	    while (!commit_thread)
+		pthread_cond_wait(&commit_cond, &commit_mutex);
+	    atexit(commit_exit);
 	} else {
-	    perror("run_script: lockf");
-	    exit(111);
+	    commit_thread = -1;
 	}
+	pthread_sigmask(SIG_SETMASK, &old, 0);
     }
-    
-    // write dependencies
-    strncpy(temp_depfile, targettmp(".dep", my_pid, target), sizeof temp_depfile);
-    // dep_fd is global
-    check_or_create_dir(redo_base(temp_depfile));
-    dep_fd = open(temp_depfile, O_CREAT|O_WRONLY|O_EXCL, 0600);
-    if (dep_fd==-1)
-	die2("could not create temp_depfile: %s", temp_depfile, 100);
-    write_dep(dep_fd, dofile);
-
-    // prepare the $3 file
-    strncpy(temp_target, targettmp(".tmp", my_pid, target), sizeof temp_target);
-    if (stat(target, &st)==-1)
-	target_mode = 0644;
-    else
-	target_mode = st.st_mode;
-    check_or_create_dir(redo_base(temp_target));
-    target_fd = open(temp_target, O_CREAT|O_RDWR|O_EXCL, target_mode);
-    if (target_fd==-1)
-	die2("could not create temp_targetfile: %s", temp_target, 100);
-    
-    // .do files are called from the directory they reside in, we need to
-    // prefix the arguments with the path from the dofile to the target
-    if (getcwd(cwd, sizeof cwd) == NULL) die2("getcwd", cwd, 100);
-    dirprefix = strchr(cwd, '\0');
-    dofile += 2;  // find_dofile starts with ./ always
-    while (strncmp(dofile, "../", 3) == 0) {
-	chdir("..");
-	dofile += 3;
-	while (*--dirprefix != '/')
-	    ;
+    if (commit_thread > 0) {
+	job->next = 0;
+	*commit_tail = job;
+	commit_tail = &job->next;
+	commit_pending++;
+	pthread_cond_broadcast(&commit_cond);
+	pthread_mutex_unlock(&commit_mutex);
+	return;
     }
-    if (*dirprefix)
-	dirprefix++;
+    pthread_mutex_unlock(&commit_mutex);
+#endif
+    job_commit(job);
+}
 
-    if (setenv("REDO_DIRPREFIX", dirprefix, 1)) die2("setenv REDO_DIRPREFIX", dirprefix, 100);
 
-    snprintf(rel_target, sizeof rel_target,
-	     "%s%s%s", dirprefix, (*dirprefix ? "/" : ""), target);
-    
-    snprintf(rel_temp_target, sizeof rel_temp_target,
-	     "%s%s%s", dirprefix, (*dirprefix ? "/" : ""), temp_target);
+// the pool recorded in the dep file of target, declared if needed by
+// now; -1 if none
+static int
+target_pool(char *target)
+{
+    struct stat st;
+    char *deps, *line, *name, pool[POOL_NAME];
+    int dir, size = 0, i = -1;
 
-    pid = fork();
-    if (pid < 0) {
-	perror("fork");
-	vacate(implicit);
-	exit(-1);
-    } else if (pid == 0) { // child
-	/*
-	  djb-style default.o.do:
-	  $1	   foo.o
-	  $2	   foo
-	  $3	   whatever.tmp
-
-	  $1	   all
-	  $2	   all (!!)
-	  $3	   whatever.tmp
-
-	  $1	   subdir/foo.o
-	  $2	   subdir/foo
-	  $3	   subdir/whatever.tmp
-	*/
-	char *basename = redo_basename(dofile, rel_target);
-	if (old_dep_fd > 0) {
-	    // Testing
-	    if (dflag)
-		fprintf(stderr, "warning run_script: global dep_fd > 0: %d\n", old_dep_fd);
-	    close(old_dep_fd);
+    if (!shared)
+	return -1;
+    checkdir_root();
+    if ((dir = checkdir_lookup(0, target, &name)) < 0 ||
+	!(deps = check_read_dep(dir, name, &st)))
+	return -1;
+    for (line = deps; line && *line; line = (line = strchr(line, '\n')) ? line + 1 : 0) {
+	if (*line == '%') {
+	    if (sscanf(line + 1, "%31s %d", pool, &size) >= 1)
+		i = pool_find(pool, size);
+	    break;
 	}
-	close(lock_fd);
-	setenvfd("REDO_DEP_FD", dep_fd);
-	setenvfd("REDO_LEVEL", level + 1);
-	// Testing: deadlock checking
-	setenvfd(target_hash, getpid());
-	
-	if (dup2(target_fd, 1)==-1) die("run_script, dup2", 100);
-	if (access(dofile, X_OK) != 0)   // run -x files with /bin/sh
-	    execl("/bin/sh", "/bin/sh", xflag > 0 ? "-ex" : "-e",
-		  dofile, rel_target, basename, rel_temp_target, (char *)0);
-	else
-	    execl(dofile,
-		  dofile, rel_target, basename, rel_temp_target, (char *)0);
-	vacate(implicit);
-	exit(-1);
-    } else {
-	struct job *job = malloc(sizeof *job);
-	if (!job)
-	    exit(-1);
-	
-	close(target_fd);
-	close(dep_fd);
-	dep_fd = old_dep_fd;
-
-	job->pid = pid;
-	job->lock_fd = lock_fd;
-	job->target = orig_target;
-	job->temp_depfile = strdup(temp_depfile);
-	job->temp_target = strdup(temp_target);
-	job->implicit = implicit;
-
-	insert_job(job);
-	
-	if (dflag)
-	    fprintf(stderr, "%*.*sredo %s # %s [%d]\n",
-		    level, level, " ", orig_target, dofile, pid);
     }
+    free(deps);
+    return i;
 }
 
 static void
@@ -923,6 +5631,11 @@ redo_ifchange(int targetc, char *targetv[])
     pid_t pid;
     int status;
     struct job *job;
+    struct rusage ru;
+    int64_t waiting = 0;   // for a token since
+    char path[2*PATH_MAX], **started;   // normalized targets run
+    char *pooled = 0;   // target whose pool is known
+    int i, nstarted = 0, deferred = 0, pool = -1, commit;
 
     int targeti = 0;
 
@@ -931,36 +5644,98 @@ redo_ifchange(int targetc, char *targetv[])
 
 
     create_pool();
+    throttle_setup();
+    durability_start();
+    verified_start();
+    check_build = 1;
 
     // check all targets whether needing rebuild
     for (targeti = 0; targeti < targetc; targeti++)
 	skip[targeti] = check_deps(targetv[targeti]);
+    if (!(started = malloc(targetc * sizeof *started)))
+	die("out of memory", 100);
 
     targeti = 0;
     while (1) {
 	int procured = 0;
 	if (targeti < targetc) {
-	    char *target = targetv[targeti];
+	    char *target = targetv[targeti], *primary;
 
 	    if (skip[targeti]) {
 		targeti++;
 		continue;
 	    }
 
+	    // outputs are built by building their target, once
+	    if ((primary = output_primary(target))) {
+		target = primary;
+	    } else if ((jobhead || commit_pending || deferred < targetc - targeti - 1) &&
+		       !has_dofile(target)) {
+		// it may be an output of a job not done yet, or of a
+		// target after it: build those first
+		if (jobhead)
+		    goto wait;
+		if (commit_drain())
+		    continue;
+		memmove(targetv + targeti, targetv + targeti + 1,
+			(targetc - targeti - 1) * sizeof *targetv);
+		memmove(skip + targeti, skip + targeti + 1, targetc - targeti - 1);
+		targetv[targetc - 1] = target;
+		skip[targetc - 1] = 0;
+		deferred++;
+		continue;
+	    }
+	    db_path("", target, path, sizeof path);
+	    for (i = 0; i < nstarted && strcmp(started[i], path); i++)
+		;
+	    if (i < nstarted) {
+		targeti++;
+		continue;
+	    }
+
+	    // the pool token first, but only together with a job token
+	    if (pooled != targetv[targeti]) {
+		pooled = targetv[targeti];
+		pool = target_pool(target);
+	    }
+	    unsigned pools = pool < 0 ? 0 : 1u << pool;
+	    pool_lend();
+	    slot_claim();
 	    int implicit = implicit_jobs > 0;
-	    if (try_procure()) {
-		procured = 1;
+	    jitter();
+	    if (pool_take(pools) && !(procured = try_procure()))
+		pool_give(pools);
+	    if (procured) {
 		targeti++;
-		run_script(target, implicit);
+		if (waiting) {
+		    count(M_TOKEN_WAIT_NS, monotonic_ns() - waiting);
+		    waiting = 0;
+		}
+		if (!(started[nstarted++] = strdup(path)))
+		    die("out of memory", 100);
+		deferred = 0;
+		run_script(target, implicit, pools);
+	    } else if (!waiting) {
+		count(M_TOKEN_WAITS, 1);
+		waiting = monotonic_ns();
+	    }
+	    if (!procured && !jobhead) {
+		slot_wait();
+		continue;
 	    }
 	}
 
-	pid = waitpid(-1, &status, procured ? WNOHANG : 0);
+    wait:
+	pid = wait4(-1, &status, procured ? WNOHANG : 0, &ru);
+
+	throttle();
 
 	if (pid == 0)
 	    continue;  // nohang
 
 	if (pid < 0) {
+	    if (errno == EINTR)
+		continue;   // throttle tick
 	    if (errno == ECHILD && targeti < targetc)
 		continue;   // no child yet???
 	    else
@@ -976,79 +5751,701 @@ redo_ifchange(int targetc, char *targetv[])
 	    exit(-1);  // we're completely corrupted, go suicide
 		
 	remove_job(job);
+	commit = 0;
+	jitter();
 
 	if (job->target) { // ToDo: what jobs don't have targets (or empty targets)?
+	    struct usage usage;
+
+	    job_usage(job, &ru, &usage);
+	    write_usage(targetchdir(job->target), &usage, status);
+	    if (status)
+		count(M_FAILED, 1);
 	    // ToDo: what if job exit status < 0?
-	    if (status > 0) {
-		remove_temp(job->temp_depfile);
-		remove_temp(job->temp_target);
-	    } else {
-		struct stat st;
-		char *target = targetchdir(job->target);
-		char *depfile = targetdep(target);
-		int dfd;
-
-		// Note: what if.. we can't open it?
-		dfd = open(job->temp_depfile, O_WRONLY | O_APPEND);
-				
-		if (stat(job->temp_target, &st)) {
-		    // Ohh: can't access produced output!
-		    perror(job->temp_target);
+	    // anonymous files just vanish when closed
+	    commit = status <= 0;
+	    if (!commit) {
+		if (job->dep_fd < 0)
+		    remove_temp(job->temp_depfile);
+		if (job->out_fd < 0)
 		    remove_temp(job->temp_target);
-		    // ToDo: ahmmm, we leave old target alone and do as if it were not here?
-		    redo_ifcreate(dfd, target);
-		} else {
-		    if (st.st_size) {
-			rename_temp(job->temp_target, target);
-			write_dep(dfd, target);
-		    }
-		    else {
-			remove_temp(job->temp_target);
-			dprintf(dfd, "!\n");
-		    }
-		}
-		close(dfd);
-		rename_temp(job->temp_depfile, depfile);
-		remove_temp(targetlock(target));
+		if (job->out_fd >= 0)
+		    close(job->out_fd);
+		if (job->dep_fd >= 0)
+		    close(job->dep_fd);
+		if (job->trace_fd >= 0)
+		    close(job->trace_fd);
+		free(job->deprec);
 	    }
 	}
 
-	if (!job->target)
+	if (!job->target) {
+	    struct timespec now;
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+	    count(M_LOCK_WAIT_NS, (now.tv_sec - job->start.tv_sec) * 1000000000LL +
+		  now.tv_nsec - job->start.tv_nsec);
 	    job->target = (char*) "waiting..";
+	}
 	if (dflag)
 	    fprintf(stderr, "%*.*s finish %s [%d]\n",
 		    level, level, " ", job->target, pid);
 
-	close(job->lock_fd);
-	
+	pool_give(job->pools);
 	vacate(job->implicit);
+	if (commit)
+	    commit_start(job);   // releases the lock when done
+	else
+	    close(job->lock_fd);
 
 	if (kflag < 0 && status > 0) {
 	    fprintf(stderr, "failed with status %d [%d]\n", status, pid);
 	    exit(status);
 	}
     }
+    throttle_stop();
+    commit_drain();
+    pool_unlend();
 }
 
 static void
 record_deps(int targetc, char *targetv[])
 {
     int targeti = 0;
-    int fd;
 
     dep_fd = envfd("REDO_DEP_FD");
     
     if (dep_fd < 0)
 	return;
 
-    fchdir(dir_fd);
+    changedir(dir_fd, 0);
 
-    for (targeti = 0; targeti < targetc; targeti++) {
-	fd = open(targetv[targeti], O_RDONLY);
-	if (fd < 0)
-	    continue;
+    // write_dep() skips targets which cannot be opened
+    for (targeti = 0; targeti < targetc; targeti++)
 	write_dep(dep_fd, targetv[targeti]);
+}
+
+// database queries
+
+// temporary files in database directories, see targettmp()
+static int
+is_tempname(const char *name)
+{
+    return (!strncmp(name, ".dep.", 5) || !strncmp(name, ".tmp.", 5)) &&
+	name[5] >= '0' && name[5] <= '9';
+}
+
+// call fn for each file in the database below directory dir (a path
+// relative to root) whose name ends in suffix, with the path of its
+// target.  In .redo directories unless db is set, then every
+// directory below root is a database directory.
+static void
+db_walk_dir(const char *root, const char *dir, int db, const char *suffix,
+	    void (*fn)(const char *target, const char *file, void *arg), void *arg)
+{
+    char path[PATH_MAX], target[PATH_MAX];
+    size_t slen = strlen(suffix), len;
+    struct dirent *de;
+    DIR *d;
+
+    snprintf(path, sizeof path, "%s/%s", root, dir);
+    if (!(d = opendir(path)))
+	return;
+    while ((de = readdir(d))) {
+	char *name = de->d_name;
+	if (!strcmp(name, ".") || !strcmp(name, ".."))
+	    continue;
+	if (!db && !strcmp(name, ".redo")) {
+	    char sub[PATH_MAX];
+	    snprintf(sub, sizeof sub, "%s%s.redo", dir, *dir ? "/" : "");
+	    db_walk_dir(root, sub, 2, suffix, fn, arg);
+	    continue;
+	}
+	if (de->d_type == DT_DIR) {
+	    // skip .git and the like, unless below REDO_DB_DIR
+	    if (db < 2 && (db || *name != '.')) {
+		char sub[PATH_MAX];
+		snprintf(sub, sizeof sub, "%s%s%s", dir, *dir ? "/" : "", name);
+		db_walk_dir(root, sub, db, suffix, fn, arg);
+	    }
+	    continue;
+	}
+	len = strlen(name);
+	if (!db || len <= slen || strcmp(name + len - slen, suffix) || is_tempname(name))
+	    continue;
+	// the target is next to .redo, or at the same place below root
+	if (db == 2)
+	    snprintf(target, sizeof target, "%.*s%.*s", (int)(strlen(dir) - 5), dir,
+		     (int)(len - slen), name);
+	else
+	    snprintf(target, sizeof target, "%s%s%.*s", dir, *dir ? "/" : "",
+		     (int)(len - slen), name);
+	snprintf(path, sizeof path, "%s/%s/%s", root, dir, name);
+	fn(target, path, arg);
+    }
+    closedir(d);
+}
+
+static void
+db_walk(const char *suffix, void (*fn)(const char *target, const char *file, void *arg), void *arg)
+{
+    char cwd[PATH_MAX], root[2*PATH_MAX];
+
+    if (db_dir) {
+	if (!getcwd(cwd, sizeof cwd))
+	    die("getcwd", 111);
+	snprintf(root, sizeof root, "%s%s", db_dir, cwd);
+	db_walk_dir(root, "", 1, suffix, fn, arg);
+    } else {
+	db_walk_dir(".", "", 0, suffix, fn, arg);
+    }
+}
+
+struct stat_entry {
+    char *target;
+    struct usage u;
+    int status;
+};
+struct stats {
+    struct stat_entry *e;
+    int n, a;
+};
+
+// parse a .rusage file written by write_usage(), 0 if there is none
+static int
+read_usage(const char *file, struct usage *u, int *status)
+{
+    long long user, sys, maxrss, inblock, oublock, wall;
+    int ok;
+    FILE *f;
+
+    *status = 0;
+    if (!(f = fopen(file, "r")))
+	return 0;
+    ok = fscanf(f, "user=%lld sys=%lld maxrss=%lld inblock=%lld oublock=%lld wall=%lld status=%d",
+		&user, &sys, &maxrss, &inblock, &oublock, &wall, status) >= 6;
+    fclose(f);
+    if (ok) {
+	u->user = user;
+	u->sys = sys;
+	u->maxrss = maxrss;
+	u->inblock = inblock;
+	u->oublock = oublock;
+	u->wall = wall;
+    }
+    return ok;
+}
+
+static void
+stats_add(const char *target, const char *file, void *arg)
+{
+    struct stats *st = arg;
+    struct stat_entry *e;
+
+    if (st->n == st->a &&
+	!(st->e = realloc(st->e, (st->a = st->a ? 2*st->a : 64) * sizeof *st->e)))
+	die("out of memory", 100);
+    e = &st->e[st->n];
+    if (!read_usage(file, &e->u, &e->status))
+	return;
+    if (!(e->target = strdup(target)))
+	die("out of memory", 100);
+    st->n++;
+}
+
+static int stats_metric;
+
+static int64_t
+stats_value(const struct stat_entry *e)
+{
+    switch (stats_metric) {
+    case 0: return e->u.user + e->u.sys;
+    case 1: return e->u.user;
+    case 2: return e->u.sys;
+    case 3: return e->u.maxrss;
+    case 4: return e->u.inblock + e->u.oublock;
+    default: return e->u.wall;
+    }
+}
+
+static int
+stats_cmp(const void *a, const void *b)
+{
+    int64_t va = stats_value(a), vb = stats_value(b);
+    return va < vb ? 1 : va > vb ? -1 :
+	strcmp(((const struct stat_entry *)a)->target, ((const struct stat_entry *)b)->target);
+}
+
+// redo --stats [N]: top N targets below the current directory by
+// each metric recorded by the last build of each target
+static void
+stats_report(int top)
+{
+    static const char *titles[] = {
+	"cpu time (user+sys), s", "user time, s", "system time, s",
+	"max rss, KiB", "block i/o, operations", "wall time, s",
+    };
+    struct stats st = { 0, 0, 0 };
+    int64_t cpu = 0;
+    int i;
+
+    db_walk(".rusage", stats_add, &st);
+    for (i = 0; i < st.n; i++)
+	cpu += st.e[i].u.user + st.e[i].u.sys;
+    printf("%d targets, cpu time %.3f s\n", st.n, cpu / 1e6);
+
+    for (stats_metric = 0; stats_metric < 6; stats_metric++) {
+	qsort(st.e, st.n, sizeof *st.e, stats_cmp);
+	printf("\n%s:\n", titles[stats_metric]);
+	for (i = 0; i < st.n && i < top; i++) {
+	    int64_t v = stats_value(&st.e[i]);
+	    if (stats_metric == 3 || stats_metric == 4)
+		printf("%12" PRId64 "  %s%s\n", v, st.e[i].target,
+		       st.e[i].status ? " (failed)" : "");
+	    else
+		printf("%12.3f  %s%s\n", v / 1e6, st.e[i].target,
+		       st.e[i].status ? " (failed)" : "");
+	}
+    }
+}
+
+// the dependency graph below the current directory, as recorded
+
+/*
+  redo-targets, redo-sources, redo-ood, redo-whatdepends and
+  redo-graph read all dep files below the current directory once.
+  Their paths are relative to the directory of the target, and made
+  relative to the current directory here.
+*/
+
+struct db_target {
+    char *name;
+    char *deps;       // the dep file, lines split at 0
+    int ndeps;
+    struct usage u;
+    int has_usage, status;
+    int mark;
+};
+struct db_edge {
+    char *dep;        // path of the dependency, "dir/glob" for trees
+    char type;        // of the dep line, '=', '+', '-' or '*'
+    int target;
+};
+struct db {
+    struct db_target *t;
+    int n, a;
+    struct db_edge *e;
+    int ne, ae;
+    struct db_edge *tree;   // '*' lines, matched by db_in_tree()
+    int nt, at;
+};
+
+// name in directory dir, both relative to the current directory,
+// with . and .. resolved lexically
+static void
+db_path(const char *dir, const char *name, char *out, size_t size)
+{
+    char buf[2*PATH_MAX], *s, *next;
+    size_t len = 0, root;
+
+    snprintf(buf, sizeof buf, "%s%s%s", *name == '/' ? "" : dir,
+	     *name != '/' && *dir ? "/" : "", name);
+    root = *buf == '/';
+    if (root)
+	out[len++] = '/';
+    out[len] = 0;
+    for (s = buf; s; s = next) {
+	if ((next = strchr(s, '/')))
+	    *next++ = 0;
+	if (!*s || !strcmp(s, "."))
+	    continue;
+	if (!strcmp(s, "..") && len > root) {
+	    char *last = strrchr(out, '/');
+	    last = last ? last + 1 : out;
+	    if (strcmp(last, "..")) {
+		len = last - out;
+		if (len > root)
+		    len--;
+		out[len] = 0;
+		continue;
+	    }
+	} else if (!strcmp(s, "..") && root) {
+	    continue;
+	}
+	if (len > root && len + 1 < size)
+	    out[len++] = '/';
+	len += snprintf(out + len, size - len, "%s", s);
+	if (len >= size)
+	    len = size - 1;
+    }
+    if (!len)
+	snprintf(out, size, ".");
+}
+
+// the path of the file of dep line line of target t, 0 if it has none
+static char *
+db_dep(struct db_target *t, const char *line, char *out, size_t size)
+{
+    char dir[PATH_MAX];
+    const char *slash = strrchr(t->name, '/');
+
+    snprintf(dir, sizeof dir, "%.*s", slash ? (int)(slash - t->name) : 0, t->name);
+    if ((*line == '=' || *line == '+' || *line == '*') &&
+	strlen(line) > 1 + HASH_CHARS + 1 + 16 + 1)
+	db_path(dir, line + 1 + HASH_CHARS + 1 + 16 + 1, out, size);
+    else if (*line == '-' && line[1])
+	db_path(dir, line + 1, out, size);
+    else
+	return 0;
+    return out;
+}
+
+static void
+db_add(const char *target, const char *file, void *arg)
+{
+    struct db *db = arg;
+    struct db_target *t;
+    struct stat st;
+    char usage[PATH_MAX];
+    ssize_t r, len = 0;
+    int fd;
+    char *s;
+
+    if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0)
+	return;
+    if (fstat(fd, &st) < 0) {
 	close(fd);
+	return;
+    }
+    if (db->n == db->a &&
+	!(db->t = realloc(db->t, (db->a = db->a ? 2*db->a : 256) * sizeof *db->t)))
+	die("out of memory", 100);
+    t = &db->t[db->n++];
+    if (!(t->deps = malloc(st.st_size + 1)) || !(t->name = strdup(target)))
+	die("out of memory", 100);
+    while (len < st.st_size && (r = read(fd, t->deps + len, st.st_size - len)) > 0)
+	len += r;
+    close(fd);
+    t->deps[len] = 0;
+    // the last line may lack its newline
+    for (t->ndeps = 0, s = t->deps; *s; t->ndeps++) {
+	if ((s = strchr(s, '\n')))
+	    *s++ = 0;
+	else
+	    break;
+    }
+    if (len && t->deps[len-1])
+	t->ndeps++;
+    snprintf(usage, sizeof usage, "%.*s.rusage", (int)strlen(file) - 4, file);
+    t->has_usage = read_usage(usage, &t->u, &t->status);
+    t->mark = 0;
+}
+
+static int
+db_target_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct db_target *)a)->name, ((const struct db_target *)b)->name);
+}
+
+static int
+db_edge_cmp(const void *a, const void *b)
+{
+    const struct db_edge *x = a, *y = b;
+    int c = strcmp(x->dep, y->dep);
+    return c ? c : x->target - y->target;
+}
+
+static struct db_target *
+db_find(struct db *db, const char *name)
+{
+    struct db_target key;
+    key.name = (char *)name;
+    return bsearch(&key, db->t, db->n, sizeof *db->t, db_target_cmp);
+}
+
+// the next line after line in a dep file
+static char *
+db_next(char *line)
+{
+    return strchr(line, 0) + 1;
+}
+
+// all targets, sorted by name, and their dependencies, sorted by path
+static void
+db_load(struct db *db)
+{
+    char path[2*PATH_MAX], *line;
+    struct db_edge *e;
+    int i, j;
+
+    memset(db, 0, sizeof *db);
+    db_walk(".dep", db_add, db);
+    qsort(db->t, db->n, sizeof *db->t, db_target_cmp);
+    for (i = 0; i < db->n; i++) {
+	struct db_target *t = &db->t[i];
+	for (j = 0, line = t->deps; j < t->ndeps; j++, line = db_next(line)) {
+	    if (!db_dep(t, line, path, sizeof path) || !strcmp(path, t->name))
+		continue;   // a target depends on itself
+	    if (*line == '*') {
+		if (db->nt == db->at &&
+		    !(db->tree = realloc(db->tree, (db->at = db->at ? 2*db->at : 16) * sizeof *db->tree)))
+		    die("out of memory", 100);
+		e = &db->tree[db->nt++];
+	    } else {
+		if (db->ne == db->ae &&
+		    !(db->e = realloc(db->e, (db->ae = db->ae ? 2*db->ae : 1024) * sizeof *db->e)))
+		    die("out of memory", 100);
+		e = &db->e[db->ne++];
+	    }
+	    if (!(e->dep = strdup(path)))
+		die("out of memory", 100);
+	    e->type = *line;
+	    e->target = i;
+	}
+    }
+    qsort(db->e, db->ne, sizeof *db->e, db_edge_cmp);
+}
+
+static void
+redo_targets()
+{
+    struct db db;
+    int i;
+
+    db_load(&db);
+    for (i = 0; i < db.n; i++)
+	printf("%s\n", db.t[i].name);
+}
+
+// existing files something depends on which are not targets
+static void
+redo_sources()
+{
+    struct db db;
+    int i;
+
+    db_load(&db);
+    for (i = 0; i < db.ne; i++) {
+	char *dep = db.e[i].dep;
+	if (db.e[i].type != '=' || (i > 0 && !strcmp(dep, db.e[i-1].dep)))
+	    continue;
+	if (!db_find(&db, dep) && access(dep, F_OK) == 0)
+	    printf("%s\n", dep);
+    }
+}
+
+// targets which need a rebuild, without building anything: the
+// checks neither build nor write to .redo
+static void
+redo_ood()
+{
+    struct db db;
+    int i;
+
+    db_readonly = 1;
+    db_load(&db);
+    for (i = 0; i < db.n; i++)
+	if (!check_deps(db.t[i].name))
+	    printf("%s\n", db.t[i].name);
+}
+
+// whether the tree dependency dirglob covers path: a file below dir
+// whose basename matches glob, or a directory below dir
+static int
+db_in_tree(const char *dirglob, const char *path)
+{
+    const char *slash = strrchr(dirglob, '/'), *glob = dirglob, *base;
+    struct stat st;
+    size_t len;
+
+    if (slash) {
+	len = slash - dirglob;
+	if (strncmp(path, dirglob, len) != 0 || path[len] != '/' || !path[len+1])
+	    return 0;
+	glob = slash + 1;
+    } else if (*path == '/' || !strcmp(path, ".") || !strcmp(path, "..") ||
+	       !strncmp(path, "../", 3)) {
+	return 0;   // the tree is the current directory
+    }
+    if (!strncmp(path, ".redo/", 6) || strstr(path, "/.redo/"))
+	return 0;
+    base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    return fnmatch(glob, base, 0) == 0 || (stat(path, &st) == 0 && S_ISDIR(st.st_mode));
+}
+
+// mark the targets depending on path, directly or through others
+static void
+db_mark(struct db *db, const char *path)
+{
+    int lo = 0, hi = db->ne, mid;
+
+    // the first edge from path
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (strcmp(db->e[mid].dep, path) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    for (; lo < db->ne && !strcmp(db->e[lo].dep, path); lo++) {
+	struct db_target *t = &db->t[db->e[lo].target];
+	if (!t->mark) {
+	    t->mark = 1;
+	    db_mark(db, t->name);
+	}
+    }
+    for (lo = 0; lo < db->nt; lo++) {
+	struct db_target *t = &db->t[db->tree[lo].target];
+	if (!t->mark && db_in_tree(db->tree[lo].dep, path)) {
+	    t->mark = 1;
+	    db_mark(db, t->name);
+	}
+    }
+}
+
+// targets which are rebuilt when one of the files changes, or, for
+// redo-ifcreate dependencies, appears
+static void
+redo_whatdepends(int argc, char *argv[])
+{
+    char path[2*PATH_MAX];
+    struct db db;
+    int i;
+
+    db_load(&db);
+    for (i = 0; i < argc; i++) {
+	db_path("", argv[i], path, sizeof path);
+	db_mark(&db, path);
+    }
+    for (i = 0; i < db.n; i++)
+	if (db.t[i].mark)
+	    printf("%s\n", db.t[i].name);
+}
+
+// s as a quoted string, for DOT and JSON
+static void
+print_quoted(const char *s)
+{
+    putchar('"');
+    for (; *s; s++) {
+	if (*s == '"' || *s == '\\')
+	    printf("\\%c", *s);
+	else if ((unsigned char)*s < 0x20)
+	    printf("\\u%04x", *s);
+	else
+	    putchar(*s);
+    }
+    putchar('"');
+}
+
+// redo-graph [--json]: targets with their dependencies and the
+// resources used by their last build.  Dependencies which must not
+// exist (redo-ifcreate) are dashed edges, or "absent" in JSON.
+static void
+redo_graph(int json)
+{
+    char path[2*PATH_MAX], *line;
+    struct db db;
+    int i, j, n;
+
+    db_load(&db);
+    printf(json ? "{\"targets\": [" : "digraph redo {\n");
+    for (i = 0; i < db.n; i++) {
+	struct db_target *t = &db.t[i];
+	int always = 0;
+
+	if (json) {
+	    printf("%s\n  {\"name\": ", i ? "," : "");
+	    print_quoted(t->name);
+	    if (t->has_usage)
+		printf(", \"wall_seconds\": %.6f, \"cpu_seconds\": %.6f, \"status\": %d",
+		       t->u.wall / 1e6, (t->u.user + t->u.sys) / 1e6, t->status);
+	} else {
+	    printf("  ");
+	    print_quoted(t->name);
+	    if (t->has_usage)
+		printf(" [shape=box, xlabel=\"%.3f s\"];\n", t->u.wall / 1e6);
+	    else
+		printf(" [shape=box];\n");
+	}
+	for (n = 0; n < 2; n++) {   // '=' lines, then '-' lines
+	    int first = 1;
+	    for (j = 0, line = t->deps; j < t->ndeps; j++, line = db_next(line)) {
+		always |= *line == '!';
+		if (*line != "=-"[n] || !db_dep(t, line, path, sizeof path) ||
+		    !strcmp(path, t->name))
+		    continue;
+		if (json) {
+		    printf(!first ? ", " : n ? ", \"absent\": [" : ", \"deps\": [");
+		    print_quoted(path);
+		} else {
+		    printf("  ");
+		    print_quoted(t->name);
+		    printf(" -> ");
+		    print_quoted(path);
+		    printf(n ? " [style=dashed];\n" : ";\n");
+		}
+		first = 0;
+	    }
+	    if (json && !first)
+		printf("]");
+	}
+	if (json)
+	    printf(", \"always\": %s}", always ? "true" : "false");
+    }
+    printf(json ? "\n]}\n" : "}\n");
+}
+
+// redo-ifchange --tree dir [glob]
+static void
+record_tree(int argc, char *argv[])
+{
+    char dirglob[PATH_MAX];
+    char *dir, *e, *hash;
+    struct stat st;
+
+    if (argc < 1 || argc > 2)
+	die("usage: redo-ifchange --tree dir [glob]", 1);
+    dep_fd = envfd("REDO_DEP_FD");
+    if (dep_fd < 0)
+	return;
+
+    changedir(dir_fd, 0);
+
+    dir = argv[0];
+    for (e = strchr(dir, '\0'); e > dir + 1 && e[-1] == '/'; )
+	*--e = 0;
+    snprintf(dirglob, sizeof dirglob, "%s/%s", dir, argc > 1 ? argv[1] : "*");
+    checkdir_root();
+    if (!(hash = tree_hash(0, dirglob)) || stat(dir, &st) < 0)
+	die2("cannot read dependency tree", dir, 111);
+    dprintf(dep_fd, "*%s %016" PRIx64 " %s%s\n",
+	    hash, (uint64_t)st.st_ctime, (*dir == '/' ? "" : uprel), dirglob);
+}
+
+/* handle jdebp long options: getopt() splits unknown --options into
+   single characters, so rewrite them to their short form first */
+static void
+longopts(int argc, char *argv[])
+{
+    static const char *opts[][2] = {
+	{ "--silent", "-s" }, { "--quiet", "-s" },
+	{ "--keep-going", "-k" }, { "--debug", "-d" },
+	{ "--verbose", "-v" }, { "--print", "-v" },
+	{ "--jobs", "-j" }, { "--directory", "-C" },
+	{ "--tree", "-T" }, { "--load-average", "-l" },
+	{ "--stats", "-S" }, { "--json", "-J" },
+    };
+    size_t j;
+    int i;
+
+    for (i = 1; i < argc && argv[i][0] == '-' && strcmp(argv[i], "--"); i++) {
+	for (j = 0; j < sizeof opts / sizeof opts[0]; j++)
+	    if (!strcmp(argv[i], opts[j][0]))
+		argv[i] = (char *)opts[j][1];
+	// skip the argument of a trailing -j, -l or -C
+	if (argv[i][1] != '-' && strchr("jlC", argv[i][strlen(argv[i])-1]))
+	    i++;
     }
 }
 
@@ -1056,7 +6453,7 @@ int
 main(int argc, char *argv[])
 {
     char *program;
-    int opt, i;
+    int opt, i, tflag = 0, sflag = 0, json = 0;
 
     level = envfd("REDO_LEVEL");
     if (level < 0)
@@ -1067,6 +6464,12 @@ main(int argc, char *argv[])
     else
 	program = argv[0];
 
+    // the arguments of a job, not ours
+    if (!strcmp(program, "redo-worker") && argc > 1 && !strcmp(argv[1], "--job"))
+	worker_client(argc - 1, argv + 1);
+    if (!strcmp(program, "redo") && argc == 2 && !strcmp(argv[1], "--lock-wait"))
+	lock_wait();
+
     /* jdebp:
        -s, --silent, --quiet .. Operate quietly.
        -k, --keep-going .. Continue with the next target if a .do script fails
@@ -1088,11 +6491,16 @@ main(int argc, char *argv[])
        -x ..
        -X ..
        -j n .. -j n, --jobs n
+       -l load .. -l load, --load-average load
        -C path .. -C path , --directory path
+       -T .. --tree (redo-ifchange)
+       -S .. --stats [N] (redo)
+       -J .. --json (redo-graph)
     */
 
+    longopts(argc, argv);
     opterr = 0;
-    while ((opt = getopt(argc, argv, "+dfkvVxXj:C:")) != -1) {
+    while ((opt = getopt(argc, argv, "+dfksvVxXj:l:C:TSJ")) != -1) {
 	switch (opt) {
 	case 'd':
 	    setenvfd("REDO_DEBUG", 1);
@@ -1123,52 +6531,35 @@ main(int argc, char *argv[])
 	case 'j':
 	    if(setenv("JOBS", optarg, 1)) die("setenv JOBS", 100);
 	    break;
+	case 'l':
+	    if(setenv("REDO_LOAD", optarg, 1)) die("setenv REDO_LOAD", 100);
+	    break;
 	case 'C':
 	    if (chdir(optarg) < 0) {
 		perror("chdir");
 		exit(-1);
 	    }
 	    break;
-	case '?':
-	    /* handle jdbp long options */
-	    if(!strcmp(argv[optind-1],"--silent")||!strcmp(argv[optind-1],"--quiet")) {
-		setenvfd("REDO_VERBOSE", 0);
-		setenvfd("REDO_DEBUG", 0);
-		setenvfd("REDO_TRACE", 0);
-		break;
-	    }
-	    if(!strcmp(argv[optind-1],"--keep-going")) {
-		setenvfd("REDO_KEEP_GOING", 1);
-		break;
-	    }
-	    if(!strcmp(argv[optind-1],"--debug")) {
-		setenvfd("REDO_DEBUG", 1);
-		break;
-	    }
-	    if(!strcmp(argv[optind-1],"--verbose")||!strcmp(argv[optind-1],"--print")) {
-		setenvfd("REDO_VERBOSE", 1);
-		break;
-	    }
-	    if(!strcmp(argv[optind-1],"--jobs")&&argc-optind) {
-		if(setenv("JOBS", argv[optind++], 1)) die("setenv JOBS", 100);
-		break;
-	    }
-	    if(!strcmp(argv[optind-1],"--directory")&&argc-optind) {
-		if (chdir(argv[optind++]) < 0) {
-		    perror("chdir");
-		    exit(-1);
-		}
-		break;
-	    }
-	    /* yes, we want to fall through here */
+	case 'T':
+	    tflag = 1;
+	    break;
+	case 'S':
+	    sflag = 1;
+	    break;
+	case 'J':
+	    json = 1;
+	    break;
 	default:
-	    fprintf(stderr, "Usage: %s [-dfksvVxX] [-Cdir] [-jN] [TARGETS...]\n\n", program);
+	    fprintf(stderr, "Usage: %s [-dfksvVxX] [-Cdir] [-jN] [-lLOAD] [TARGETS...]\n"
+		    "       %s --stats [N]\n\n", program, program);
 	    fprintf(stderr, "%s %s\n", program, version);
 	    exit(1);
 	}
     }
     argc -= optind;
     argv += optind;
+    if (tflag && strcmp(program, "redo-ifchange") != 0)
+	die("--tree only works with redo-ifchange", 1);
 
     fflag = envfd("REDO_FORCE");
     kflag = envfd("REDO_KEEP_GOING");
@@ -1178,10 +6569,23 @@ main(int argc, char *argv[])
 	vflag = 0;
     if ((dflag = envfd("REDO_DEBUG"))==-1)
 	dflag = 0;
+    if ((tmpfile_out = envfd("REDO_TMPFILE")) < 0)
+	tmpfile_out = 0;
 
     dir_fd = keepdir();
-
-    if (strcmp(program, "redo") == 0) {
+    setup_db_dir();
+    setup_immutable();
+    setup_git();
+    setup_deptrace();
+    setup_io();
+    setup_durability();
+    setup_workers();
+    setup_jitter();
+    metrics_setup();
+
+    if (strcmp(program, "redo") == 0 && sflag) {
+	stats_report(argc > 0 ? atoi(argv[0]) : 10);
+    } else if (strcmp(program, "redo") == 0) {
 	char all[] = "all";
 	char *argv_def[] = { all };
 
@@ -1192,24 +6596,78 @@ main(int argc, char *argv[])
 
 	fflag = 1;
 	redo_ifchange(argc, argv);
-	procure();
+	slot_return();
+	audit_report();
+    } else if (strcmp(program, "redo-ifchange") == 0 && tflag) {
+	compute_uprel();
+	record_tree(argc, argv);
     } else if (strcmp(program, "redo-ifchange") == 0) {
 	compute_uprel();
 	redo_ifchange(argc, argv);
 	record_deps(argc,argv);
-	procure();
+	slot_return();
+	audit_report();
     } else if (strcmp(program, "redo-ifcreate") == 0) {
+	dep_fd = envfd("REDO_DEP_FD");
 	for (i = 0; i < argc; i++)
 	    redo_ifcreate(dep_fd, argv[i]);
     } else if (strcmp(program, "redo-always") == 0) {
+	dep_fd = envfd("REDO_DEP_FD");
 	if (dep_fd==-1) {
 	    fprintf(stderr, "error: redo-always must be invoked from within .do file\n");
 	    exit(-1);
 	}
-	dprintf(dep_fd, "!\n");
+	// see session_start()
+	char *session = getenv("REDO_SESSION");
+	dprintf(dep_fd, "!%s\n", session ? session : "");
+    } else if (strcmp(program, "redo-output") == 0) {
+	char path[2*PATH_MAX], *dp = getenv("REDO_DIRPREFIX");
+	size_t dplen = dp ? strlen(dp) : 0;
+	dep_fd = envfd("REDO_DEP_FD");
+	if (dep_fd==-1) {
+	    fprintf(stderr, "error: redo-output must be invoked from within .do file\n");
+	    exit(-1);
+	}
+	compute_uprel();
+	// paths relative to the directory of the target
+	for (i = 0; i < argc; i++) {
+	    db_path("", argv[i], path, sizeof path);
+	    if (dplen && !strncmp(path, dp, dplen) && path[dplen] == '/')
+		dprintf(dep_fd, "+%s\n", path + dplen + 1);
+	    else
+		dprintf(dep_fd, "+%s%s\n", *path == '/' ? "" : uprel, path);
+	}
+    } else if (strcmp(program, "redo-pool") == 0) {
+	dep_fd = envfd("REDO_DEP_FD");
+	if (dep_fd==-1) {
+	    fprintf(stderr, "error: redo-pool must be invoked from within .do file\n");
+	    exit(-1);
+	}
+	if (argc < 1) {
+	    fprintf(stderr, "Usage: %s NAME [N]\n", program);
+	    exit(1);
+	}
+	create_pool();
+	redo_pool(argv[0], argc > 1 ? atoi(argv[1]) : 0);
     } else if (strcmp(program, "redo-hash") == 0) {
 	for (i = 0; i < argc; i++)
 	    write_dep(1, argv[i]);
+    } else if (strcmp(program, "redo-targets") == 0) {
+	redo_targets();
+    } else if (strcmp(program, "redo-sources") == 0) {
+	redo_sources();
+    } else if (strcmp(program, "redo-ood") == 0) {
+	redo_ood();
+    } else if (strcmp(program, "redo-whatdepends") == 0) {
+	redo_whatdepends(argc, argv);
+    } else if (strcmp(program, "redo-graph") == 0) {
+	redo_graph(json);
+    } else if (strcmp(program, "redo-worker") == 0) {
+	if (argc != 1) {
+	    fprintf(stderr, "Usage: %s SOCKET\n", program);
+	    exit(1);
+	}
+	worker_serve(argv[0]);
     } else {
 	fprintf(stderr, "not implemented %s\n", program);
 	exit(-1);
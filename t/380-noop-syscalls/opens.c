@@ -0,0 +1,102 @@
+/* LD_PRELOAD shim for all.do: appends the name of every file opened,
+   but not of directories, to the file OPENS_LOG, one line each. */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int
+logged(int dirfd, const char *path, int flags, mode_t mode)
+{
+    static int (*next_openat)(int, const char *, int, ...);
+    static int log = -2;
+    char buf[4200];
+    int r, n;
+
+    if (!next_openat)
+	next_openat = (int (*)(int, const char *, int, ...))dlsym(RTLD_NEXT, "openat");
+    if (log == -2)
+	log = getenv("OPENS_LOG") ?
+	    next_openat(AT_FDCWD, getenv("OPENS_LOG"),
+			O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644) : -1;
+    r = next_openat(dirfd, path, flags, mode);
+    if (log >= 0 && r >= 0 && !(flags & O_DIRECTORY)) {
+	n = snprintf(buf, sizeof buf, "%s\n", path);
+	if (n > 0 && (size_t)n < sizeof buf)
+	    write(log, buf, n);
+    }
+    return r;
+}
+
+// the mode argument is only there with O_CREAT or O_TMPFILE
+#define MODE(flags, mode) \
+    mode_t mode = 0; \
+    if ((flags) & O_CREAT || ((flags) & O_TMPFILE) == O_TMPFILE) { \
+	va_list ap; \
+	va_start(ap, flags); \
+	mode = va_arg(ap, int); \
+	va_end(ap); \
+    }
+
+int
+open(const char *path, int flags, ...)
+{
+    MODE(flags, mode);
+    return logged(AT_FDCWD, path, flags, mode);
+}
+
+int
+open64(const char *path, int flags, ...)
+{
+    MODE(flags, mode);
+    return logged(AT_FDCWD, path, flags, mode);
+}
+
+int
+openat(int dirfd, const char *path, int flags, ...)
+{
+    MODE(flags, mode);
+    return logged(dirfd, path, flags, mode);
+}
+
+int
+openat64(int dirfd, const char *path, int flags, ...)
+{
+    MODE(flags, mode);
+    return logged(dirfd, path, flags, mode);
+}
+
+// the fortified variants, without a mode
+int __open_2(const char *path, int flags);
+int __open64_2(const char *path, int flags);
+int __openat_2(int dirfd, const char *path, int flags);
+int __openat64_2(int dirfd, const char *path, int flags);
+
+int
+__open_2(const char *path, int flags)
+{
+    return logged(AT_FDCWD, path, flags, 0);
+}
+
+int
+__open64_2(const char *path, int flags)
+{
+    return logged(AT_FDCWD, path, flags, 0);
+}
+
+int
+__openat_2(int dirfd, const char *path, int flags)
+{
+    return logged(dirfd, path, flags, 0);
+}
+
+int
+__openat64_2(int dirfd, const char *path, int flags)
+{
+    return logged(dirfd, path, flags, 0);
+}